@@ -18,41 +18,781 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
 
 #include "drmr.h"
 #include "drmr_hydrogen.h"
 
 #define VELOCITY_MAX 127
 
+#define DB3SCALE -0.8317830986718104f
+#define DB3SCALEPO 1.8317830986718104f
+// taken from lv2 example amp plugin
+#define DB_CO(g) ((g) > GAIN_MIN ? powf(10.0f, (g) * 0.05f) : 0.0f)
+
+// dB -> linear lookup, DB_TABLE_RES entries per dB between
+// GAIN_MIN and GAIN_MAX, linearly interpolated
+#define DB_TABLE_RES 8
+#define DB_TABLE_SIZE (66*DB_TABLE_RES+2) // 66dB range, plus one guard entry
+static float db_table[DB_TABLE_SIZE];
+static char db_table_init = 0;
+
+static void init_db_table() {
+  int i;
+  if (db_table_init) return;
+  for (i = 0;i < DB_TABLE_SIZE;i++)
+    db_table[i] = DB_CO(GAIN_MIN + ((float)i)/DB_TABLE_RES);
+  db_table[0] = 0.0f; // GAIN_MIN is -inf
+  db_table_init = 1;
+}
+
+static inline float db_to_coef(float g) {
+  float idx;
+  int i;
+  if (g <= GAIN_MIN) return 0.0f;
+  if (g >= GAIN_MAX) g = GAIN_MAX;
+  idx = (g-GAIN_MIN)*DB_TABLE_RES;
+  i = (int)idx;
+  return db_table[i] + (db_table[i+1]-db_table[i])*(idx-i);
+}
+
+/* Render kernels.  Each adds the next n_samples of a playing sample
+ * to left/right and moves its offset on.  One is generated for every
+ * sample layout and gain shape, so there are no tests inside the
+ * loops: a voice's kernel is picked by pick_kernel() when it's
+ * triggered, and whether it ramps is picked once a block. */
+typedef void (*mix_fn)(float* left, float* right, drmr_sample* cs,
+		       float coef_left, float coef_right,
+		       float step_left, float step_right,
+		       uint32_t n_samples);
+
+#define MIX_KERNEL(name,CH,GAIN_LEFT,GAIN_RIGHT)			\
+  static void name(float* left, float* right, drmr_sample* cs,		\
+		   float coef_left, float coef_right,			\
+		   float step_left, float step_right,			\
+		   uint32_t n_samples) {					\
+    const float* data = cs->data+cs->offset;				\
+    uint32_t pos,lim = (cs->limit-cs->offset)/CH;			\
+    if (lim > n_samples) lim = n_samples;				\
+    for (pos = 0;pos < lim;pos++) {					\
+      left[pos]  += data[CH*pos]*(GAIN_LEFT);				\
+      right[pos] += data[CH*pos+CH-1]*(GAIN_RIGHT);			\
+    }									\
+    cs->offset += lim*CH;						\
+  }
+
+MIX_KERNEL(mix_mono,1,coef_left,coef_right)
+MIX_KERNEL(mix_mono_ramp,1,coef_left+step_left*pos,coef_right+step_right*pos)
+MIX_KERNEL(mix_stereo,2,coef_left,coef_right)
+MIX_KERNEL(mix_stereo_ramp,2,coef_left+step_left*pos,coef_right+step_right*pos)
+
+// for samples that have no data, there is nothing to mix
+static void mix_silent(float* left, float* right, drmr_sample* cs,
+		       float coef_left, float coef_right,
+		       float step_left, float step_right,
+		       uint32_t n_samples) {}
+
+struct drmr_kernel {
+  mix_fn mix[2];  // [1] ramps the gain over the block
+};
+
+// by channel count, 0 for an empty sample
+static const struct drmr_kernel kernels[3] = {
+  { { mix_silent, mix_silent } },
+  { { mix_mono, mix_mono_ramp } },
+  { { mix_stereo, mix_stereo_ramp } },
+};
+
+// the kernel for the layer a sample is about to play
+static inline const struct drmr_kernel* pick_kernel(drmr_sample* cs) {
+  return kernels+(cs->limit > 0 ? cs->info->channels : 0);
+}
+
+static inline uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return (uint64_t)ts.tv_sec*1000000000ull + ts.tv_nsec;
+}
+
+// mix cs with the gain and pan in co, see render_voice()
+static inline void render_sample(drmr_sample* cs, const drmr_coef* co, float* left,
+				 float* right, uint32_t pos, uint32_t n_samples) {
+  cs->kernel->mix[co->left_step != 0.0f || co->right_step != 0.0f]
+    (left,right,cs,(co->left+co->left_step*pos)*cs->velocity,
+     (co->right+co->right_step*pos)*cs->velocity,
+     co->left_step*cs->velocity,co->right_step*cs->velocity,n_samples);
+}
+
+/* Mix one voice of the current kit with its gain and pan into
+ * left/right, which start at frame pos of the block. */
+static inline void render_voice(DrMr *drmr, int i, float* left, float* right,
+				uint32_t pos, uint32_t n_samples) {
+  render_sample(drmr->samples+i,drmr->coefs+i,left,right,pos,n_samples);
+}
+
+// buses that don't exist are the main pair
+static inline void set_output(drmr_coef* co, int b) {
+  co->output = b > 0 && b <= DRMR_NUM_BUSES ? b : 0;
+}
+
+// output a sample plays to, the main pair if its bus isn't connected
+static inline int voice_bus(DrMr *drmr, int i) {
+  int b = drmr->coefs[i].output;
+  return drmr->left[b] && drmr->right[b] ? b : 0;
+}
+
+/* Claim voices of the current job one at a time and mix them into
+ * their outputs in left/right until none are left, returning how many
+ * were mixed.  run() and the helpers all do this at once, the CAS on
+ * job makes sure each voice is claimed by exactly one of them.
+ *
+ * run() (h NULL) mixes straight into the outputs.  A helper then marks
+ * the voice as its own in claim[], unless run() revoked it first,
+ * mixes a copy of it into its own buffers and leaves the new offset in
+ * h->offset, clearing an output's buffers the first time it mixes
+ * something into it.  The copy is only used if the voice is still
+ * ours once it's made: run() revokes a voice before it touches it
+ * again, so a helper that's late never reads it half changed. */
+static int mix_claimed(DrMr *drmr, float** left, float** right, drmr_helper* h) {
+  uint64_t job = __atomic_load_n(&drmr->job,__ATOMIC_SEQ_CST);
+  uint64_t mark;
+  int mixed = 0;
+  while ((job&0xffff) < ((job>>16)&0xffff)) {
+    uint32_t n_samples,pos,gen,j;
+    int i,b;
+    if (!__atomic_compare_exchange_n(&drmr->job,&job,job+1,0,
+				     __ATOMIC_SEQ_CST,__ATOMIC_SEQ_CST))
+      continue; // someone else got it, job now holds the latest value
+    gen = (uint32_t)(job>>32);
+    j = job&0xffff;
+    job++;
+    if (h) {
+      drmr_sample cs;
+      drmr_coef co;
+      uint64_t old = __atomic_load_n(drmr->claim+j,__ATOMIC_SEQ_CST);
+      mark = ((uint64_t)gen<<8) | (h-drmr->helpers+1);
+      // revoked, or so late a newer block already has it
+      if ((int32_t)((uint32_t)(old>>8)-gen) >= 0 ||
+	  !__atomic_compare_exchange_n(drmr->claim+j,&old,mark,0,
+				       __ATOMIC_SEQ_CST,__ATOMIC_SEQ_CST))
+	continue;
+      i = drmr->voices[j];
+      cs = drmr->samples[i];
+      co = drmr->coefs[i];
+      n_samples = drmr->job_frames;
+      pos = drmr->job_pos;
+      if (__atomic_load_n(drmr->claim+j,__ATOMIC_SEQ_CST) != mark)
+	continue;
+      b = voice_bus(drmr,i);
+      if (h->gen != gen) {
+	h->gen = gen;
+	h->touched = 0;
+      }
+      if (!(h->touched & (1u<<b))) {
+	memset(left[b],0,n_samples*sizeof(float));
+	memset(right[b],0,n_samples*sizeof(float));
+	h->touched |= 1u<<b;
+      }
+      // helper buffers only hold the job's frames
+      render_sample(&cs,&co,left[b],right[b],pos,n_samples);
+      h->offset[j] = cs.offset;
+    } else {
+      __atomic_store_n(drmr->claim+j,((uint64_t)gen<<8) | DRMR_CLAIM_RUN,
+		       __ATOMIC_SEQ_CST);
+      n_samples = drmr->job_frames;
+      pos = drmr->job_pos;
+      i = drmr->voices[j];
+      b = voice_bus(drmr,i);
+      render_voice(drmr,i,left[b]+pos,right[b]+pos,pos,n_samples);
+    }
+    mixed++;
+  }
+  return mixed;
+}
+
+static void* helper_thread(void* arg) {
+  drmr_helper* h = (drmr_helper*)arg;
+  DrMr* drmr = (DrMr*)h->drmr;
+  for(;;) {
+    while (sem_wait(&h->wake) && errno == EINTR);
+    if (__atomic_load_n(&h->quit,__ATOMIC_SEQ_CST)) break;
+    // counted as busy before looking at the job, so the loader can't
+    // free a kit between us claiming a voice and mixing it
+    __atomic_add_fetch(&drmr->busy,1,__ATOMIC_SEQ_CST);
+    mix_claimed(drmr,h->left,h->right,h);
+    // nothing more of block gen is left to claim, its voices are done
+    __atomic_store_n(&h->done,h->gen,__ATOMIC_SEQ_CST);
+    __atomic_sub_fetch(&drmr->busy,1,__ATOMIC_SEQ_CST);
+  }
+  return 0;
+}
+
+/* Wait until no helper is mixing, before freeing anything a late one
+ * could still be reading.  Loader thread only. */
+static void wait_helpers(DrMr *drmr) {
+  while (__atomic_load_n(&drmr->busy,__ATOMIC_SEQ_CST) > 0)
+    usleep(100);
+}
+
+/* Render the active voices from frame pos for n_samples frames with
+ * the helpers.  Every thread, this one included, claims voices until
+ * there are none left, so a helper that wakes late just finds nothing
+ * to do.  run() then waits for the helpers, but for no more than
+ * DRMR_PAR_WAIT of the job's length.  A helper that isn't done by then
+ * has its buffers ignored, and the voices it claimed, and any claimed
+ * but not yet marked, are revoked and mixed again here.  If the
+ * helpers were late, or didn't get a single voice, they are missing
+ * the deadline, so run() renders alone for DRMR_PAR_BACKOFF blocks
+ * before waking them again.  Call with load_mutex held. */
+static void mix_parallel(DrMr *drmr, uint32_t pos, uint32_t n_samples) {
+  int h,b,mine,late = 0;
+  uint32_t f,j;
+  char finished[DRMR_MAX_HELPERS];
+  uint64_t gen = (__atomic_load_n(&drmr->job,__ATOMIC_SEQ_CST)>>32)+1;
+  uint64_t deadline = now_ns()+(uint64_t)(DRMR_PAR_WAIT*n_samples*1e9/drmr->rate);
+  drmr->job_frames = n_samples;
+  drmr->job_pos = pos;
+  gen &= 0xffffffff;
+  if (gen == 0) gen = 1; // untouched claims are block 0
+  __atomic_store_n(&drmr->job,(gen<<32)|((uint64_t)drmr->num_voices<<16),
+		   __ATOMIC_SEQ_CST);
+  for (h = 0;h < drmr->num_helpers;h++)
+    sem_post(&drmr->helpers[h].wake);
+  mine = mix_claimed(drmr,drmr->left,drmr->right,NULL);
+  // join: everything is claimed, wait for voices still being mixed
+  while (__atomic_load_n(&drmr->busy,__ATOMIC_SEQ_CST) > 0)
+    if (now_ns() > deadline) {
+      late = 1;
+      break;
+    }
+  // decide once which helpers count, they could finish any time now
+  for (h = 0;h < DRMR_MAX_HELPERS;h++)
+    finished[h] = drmr->helpers[h].buf &&
+      __atomic_load_n(&drmr->helpers[h].done,__ATOMIC_SEQ_CST) == (uint32_t)gen &&
+      drmr->helpers[h].gen == (uint32_t)gen;
+  for (j = 0;j < (uint32_t)drmr->num_voices;j++) {
+    uint64_t c = __atomic_load_n(drmr->claim+j,__ATOMIC_SEQ_CST);
+    int owner;
+    for (;;) {
+      owner = (int)(c&0xff);
+      if ((uint32_t)(c>>8) == (uint32_t)gen &&
+	  (owner == DRMR_CLAIM_RUN || owner == DRMR_CLAIM_REVOKED ||
+	   finished[owner-1]))
+	break;
+      // not claimed yet, or its helper is late: take it back
+      if (__atomic_compare_exchange_n(drmr->claim+j,&c,(gen<<8) | DRMR_CLAIM_REVOKED,0,
+				      __ATOMIC_SEQ_CST,__ATOMIC_SEQ_CST)) {
+	int i = drmr->voices[j];
+	b = voice_bus(drmr,i);
+	render_voice(drmr,i,drmr->left[b]+pos,drmr->right[b]+pos,pos,n_samples);
+	late = 1;
+	owner = DRMR_CLAIM_RUN;
+	break;
+      }
+    }
+    if (owner != DRMR_CLAIM_RUN && owner != DRMR_CLAIM_REVOKED)
+      drmr->samples[drmr->voices[j]].offset = drmr->helpers[owner-1].offset[j];
+  }
+  if (late || mine == drmr->num_voices)
+    drmr->par_backoff = DRMR_PAR_BACKOFF;
+  for (h = 0;h < DRMR_MAX_HELPERS;h++) {
+    drmr_helper* hp = drmr->helpers+h;
+    if (!finished[h]) continue;
+    for (b = 0;b <= DRMR_NUM_BUSES;b++) {
+      if (!(hp->touched & (1u<<b))) continue;
+      for (f = 0;f < n_samples;f++) {
+	drmr->left[b][pos+f] += hp->left[b][f];
+	drmr->right[b][pos+f] += hp->right[b][f];
+      }
+    }
+  }
+}
+
+static int start_helper(DrMr *drmr, drmr_helper* h, int policy, int prio) {
+  pthread_attr_t attr;
+  struct sched_param param;
+  int b,err;
+  h->drmr = drmr;
+  h->quit = 0;
+  h->gen = 0;
+  h->done = 0;
+  h->touched = 0;
+  if (posix_memalign((void**)&h->buf,64,
+		     2*(DRMR_NUM_BUSES+1)*DRMR_HELPER_FRAMES*sizeof(float))) {
+    fprintf(stderr,"Could not allocate render helper buffers\n");
+    h->buf = NULL;
+    return 1;
+  }
+  for (b = 0;b <= DRMR_NUM_BUSES;b++) {
+    h->left[b] = h->buf+2*b*DRMR_HELPER_FRAMES;
+    h->right[b] = h->left[b]+DRMR_HELPER_FRAMES;
+  }
+  sem_init(&h->wake,0,0);
+  // helpers run at the audio thread's priority, or they'd never be on time
+  pthread_attr_init(&attr);
+  if (policy == SCHED_FIFO || policy == SCHED_RR) {
+    param.sched_priority = prio;
+    pthread_attr_setinheritsched(&attr,PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(&attr,policy);
+    pthread_attr_setschedparam(&attr,&param);
+  }
+  err = pthread_create(&h->thread,&attr,helper_thread,h);
+  pthread_attr_destroy(&attr);
+  if (err == EPERM) {
+    fprintf(stderr,"Not allowed to make render helpers realtime, starting them without\n");
+    err = pthread_create(&h->thread,NULL,helper_thread,h);
+  }
+  if (err) {
+    fprintf(stderr,"Could not start render helper: %s\n",strerror(err));
+    sem_destroy(&h->wake);
+    free(h->buf);
+    h->buf = NULL;
+    return 1;
+  }
+  return 0;
+}
+
+// the caller frees the buffers
+static void stop_helper(drmr_helper* h) {
+  __atomic_store_n(&h->quit,1,__ATOMIC_SEQ_CST);
+  sem_post(&h->wake);
+  pthread_join(h->thread,0);
+  sem_destroy(&h->wake);
+}
+
+// start or stop helpers so there are want of them.  Loader thread only.
+static void set_helpers(DrMr *drmr, int want, int policy, int prio) {
+  int oldstate;
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE,&oldstate);
+  while (drmr->running_helpers < want &&
+	 !start_helper(drmr,drmr->helpers+drmr->running_helpers,policy,prio))
+    drmr->running_helpers++;
+  pthread_mutex_lock(&drmr->load_mutex);
+  drmr->num_helpers = drmr->running_helpers < want ? drmr->running_helpers : want;
+  drmr->par_backoff = 0;
+  pthread_mutex_unlock(&drmr->load_mutex);
+  while (drmr->running_helpers > want) {
+    drmr_helper* h = drmr->helpers+(--drmr->running_helpers);
+    stop_helper(h);
+    // run() looks at the buffers of every helper when adding up a block
+    pthread_mutex_lock(&drmr->load_mutex);
+    free(h->buf);
+    h->buf = NULL;
+    pthread_mutex_unlock(&drmr->load_mutex);
+  }
+  pthread_setcancelstate(oldstate,NULL);
+}
+
+/* Move the current kits, which must have voices, to a free retired
+ * slot so they keep playing.  Returns 0 if all slots are busy, in
+ * which case the voices are just cut.  Call with load_mutex held. */
+static int retire_kit(DrMr* drmr) {
+  int r;
+  float fade_ms = drmr->kit_fade ? *(drmr->kit_fade) : 0.0f;
+  for (r = 0;r < DRMR_MAX_RETIRED;r++) {
+    drmr_retired_kit* rk = drmr->retired+r;
+    if (rk->samples) continue;
+    rk->samples = drmr->samples;
+    rk->coefs = drmr->coefs;
+    rk->num_samples = drmr->num_samples;
+    memcpy(rk->voices,drmr->voices,drmr->num_voices*sizeof(uint16_t));
+    rk->num_voices = drmr->num_voices;
+    rk->fade_len = fade_ms > 0 ? (uint32_t)(fade_ms*drmr->rate/1000.0) : 0;
+    rk->fade_left = rk->fade_len;
+    memcpy(rk->kits,drmr->cur_kits,drmr->num_cur_kits*sizeof(int));
+    rk->num_kits = drmr->num_cur_kits;
+    drmr->num_retired_voices += rk->num_voices;
+    return 1;
+  }
+  return 0;
+}
+
+// drop a reference to each of kits, freeing those nothing uses now
+static void release_kits(DrMr* drmr, int* kits, int num_kits) {
+  int k;
+  wait_helpers(drmr);
+  for (k = 0;k < num_kits;k++) {
+    drmr_stored_kit* sk = drmr->store+kits[k];
+    if (--sk->refs > 0) continue;
+    if (sk->locked) lock_samples(sk->samples,sk->num_samples,0);
+    free_samples(sk->samples,sk->num_samples);
+    free(sk->path);
+    sk->path = NULL;
+  }
+}
+
+// free retired kits whose last voice has ended
+static void reclaim_retired(DrMr* drmr) {
+  drmr_retired_kit* done[DRMR_MAX_RETIRED];
+  drmr_sample* done_samples[DRMR_MAX_RETIRED];
+  drmr_coef* done_coefs[DRMR_MAX_RETIRED];
+  int r,n = 0;
+  pthread_mutex_lock(&drmr->load_mutex);
+  for (r = 0;r < DRMR_MAX_RETIRED;r++)
+    if (drmr->retired[r].samples && drmr->retired[r].num_voices == 0) {
+      done[n] = drmr->retired+r;
+      done_coefs[n] = drmr->retired[r].coefs;
+      done_samples[n++] = drmr->retired[r].samples;
+      drmr->retired[r].samples = NULL;
+      drmr->retired[r].coefs = NULL;
+    }
+  drmr->retired_done = 0;
+  pthread_mutex_unlock(&drmr->load_mutex);
+  // the kits lists are only written by the loader, so safe to read
+  if (n > 0) wait_helpers(drmr);
+  for (r = 0;r < n;r++) {
+    free(done_samples[r]);
+    free(done_coefs[r]);
+    release_kits(drmr,done[r]->kits,done[r]->num_kits);
+  }
+}
+
+// path of kit number index, scanning or updating the kit list first
+static void kit_index_path(DrMr* drmr, int index, char* path) {
+  path[0] = 0;
+  if (index < 0) return;
+  // kits are only scanned once something asks for one by index,
+  // a restored session loads its kit by path and never needs to
+  if (!drmr->kits) {
+    drmr->kits = scan_kits();
+    drmr->kit_watch = watch_kits();
+  } else if (drmr->kit_watch)
+    update_kits(drmr->kit_watch,drmr->kits);
+  if (index < drmr->kits->num_kits && !drmr->kits->kits[index].removed)
+    snprintf(path,BUFSIZ,"%s",drmr->kits->kits[index].path);
+}
+
+static int find_stored(DrMr* drmr, char* path, int budget, int trim, int normalize) {
+  int k;
+  for (k = 0;k < DRMR_MAX_STORED;k++)
+    if (drmr->store[k].path && drmr->store[k].budget == budget &&
+	drmr->store[k].trim == trim && drmr->store[k].normalize == normalize &&
+	!strcmp(drmr->store[k].path,path))
+      return k;
+  return -1;
+}
+
+/* Load the kit at path into a free store slot, returning the slot.
+ * Returns -1 if it couldn't be loaded, -2 if a newer request cancelled
+ * the load. */
+static int store_kit(DrMr* drmr, char* path, int budget, int trim, int normalize,
+		     int lock) {
+  int k,count;
+  drmr_sample* samples;
+  for (k = 0;k < DRMR_MAX_STORED && drmr->store[k].path;k++);
+  if (k == DRMR_MAX_STORED) {
+    fprintf(stderr,"Too many kits loaded, not loading %s\n",path);
+    return -1;
+  }
+  printf("loading kit: %s\n",path);
+  samples = load_hydrogen_kit(path,drmr->rate,(size_t)budget*1048576,trim,normalize,
+			      &drmr->load_cancel,&count);
+  if (drmr->load_cancel) {
+    // a newer request came in while loading, go straight to it
+    if (samples) free_samples(samples,count);
+    return -2;
+  }
+  if (!samples) return -1;
+  // fault everything in now rather than on the first hit in run()
+  if (lock) lock_samples(samples,count,1);
+  drmr->store[k].path = strdup(path);
+  drmr->store[k].samples = samples;
+  drmr->store[k].num_samples = count;
+  drmr->store[k].budget = budget;
+  drmr->store[k].trim = trim;
+  drmr->store[k].normalize = normalize;
+  drmr->store[k].locked = lock;
+  drmr->store[k].refs = 0;
+  return k;
+}
+
+/* Lay kits out one after another, as the samples run() plays, and
+ * fill in the part each channel plays.  chan_pos is each channel's
+ * position in kits, -1 for none.  Returns the number of samples. */
+static int layout_kits(DrMr* drmr, int* kits, int num_kits, int* chan_pos,
+		       int* offset, int* first, int* count) {
+  int k,ch,total = 0;
+  for (k = 0;k < num_kits;k++) {
+    drmr_stored_kit* sk = drmr->store+kits[k];
+    offset[k] = -1;
+    if (total+sk->num_samples > DRMR_MAX_VOICES) {
+      fprintf(stderr,"More than %i instruments over all channels, %s can't be played\n",
+	      DRMR_MAX_VOICES,sk->path);
+      continue;
+    }
+    offset[k] = total;
+    total += sk->num_samples;
+  }
+  for (ch = 0;ch < DRMR_NUM_CHANNELS;ch++) {
+    k = chan_pos[ch];
+    first[ch] = count[ch] = 0;
+    if (k >= 0 && offset[k] >= 0) {
+      first[ch] = offset[k];
+      count[ch] = drmr->store[kits[k]].num_samples;
+    }
+  }
+  return total;
+}
+
+/* Put kits, laid out by layout_kits(), in place of the current kits.
+ * The caller has taken a reference to each of them.  Voices still
+ * sounding from the old kits carry on from a retired slot, and the old
+ * kits are released once they've finished. */
+static void swap_kits(DrMr* drmr, int* kits, int num_kits, int* offset, int num_samples,
+		      int* first, int* count, char* own) {
+  drmr_sample *samples,*old_samples;
+  drmr_coef *coefs,*old_coefs;
+  int old_kits[DRMR_NUM_CHANNELS];
+  int i,k,old_num_kits;
+  size_t bytes = 0;
+  // copies of the stored kits' structs, so each set of kits keeps
+  // its own playing state
+  samples = num_samples ? malloc(num_samples*sizeof(drmr_sample)) : NULL;
+  coefs = num_samples ? malloc(num_samples*sizeof(drmr_coef)) : NULL;
+  for (k = 0;k < num_kits;k++) {
+    drmr_stored_kit* sk = drmr->store+kits[k];
+    if (offset[k] >= 0)
+      memcpy(samples+offset[k],sk->samples,sk->num_samples*sizeof(drmr_sample));
+    bytes += kit_memory(sk->samples,sk->num_samples);
+  }
+  // just lock for the critical moment when we swap in the new kits
+  pthread_mutex_lock(&drmr->load_mutex);
+  old_samples = drmr->samples;
+  old_coefs = drmr->coefs;
+  old_num_kits = drmr->num_cur_kits;
+  memcpy(old_kits,drmr->cur_kits,old_num_kits*sizeof(int));
+  // gains, pans and outputs stay where they were, new places start at
+  // 0dB, centred, on the main pair
+  for (i = 0;i < num_samples;i++) {
+    coefs[i].gain = i < drmr->num_samples ? old_coefs[i].gain : 0.0f;
+    coefs[i].pan = i < drmr->num_samples ? old_coefs[i].pan : 0.0f;
+    coefs[i].output = i < drmr->num_samples ? old_coefs[i].output : 0;
+    // nan never compares equal, so the first block computes real values
+    coefs[i].coef_gain = coefs[i].coef_pan = NAN;
+    coefs[i].left_step = coefs[i].right_step = 0.0f;
+  }
+  if (old_samples && drmr->num_voices > 0) {
+    if (retire_kit(drmr))
+      old_num_kits = 0; // released by reclaim_retired()
+    else
+      fprintf(stderr,"Too many kits still playing, cutting the old kit's voices\n");
+  }
+  drmr->samples = samples;
+  drmr->coefs = coefs;
+  drmr->notify_all = 1;
+  drmr->num_samples = num_samples;
+  drmr->num_voices = 0;
+  memcpy(drmr->cur_kits,kits,num_kits*sizeof(int));
+  drmr->num_cur_kits = num_kits;
+  memcpy(drmr->chan_first,first,sizeof(drmr->chan_first));
+  memcpy(drmr->chan_count,count,sizeof(drmr->chan_count));
+  memcpy(drmr->chan_own,own,sizeof(drmr->chan_own));
+  drmr->kit_bytes = bytes;
+  pthread_mutex_unlock(&drmr->load_mutex);
+  if (old_num_kits > 0) {
+    wait_helpers(drmr);
+    free(old_samples);
+    free(old_coefs);
+    release_kits(drmr,old_kits,old_num_kits);
+  }
+}
+
+/* Use the gains, pans and outputs of a restored state, if there are
+ * any, or if the state's kit couldn't be loaded just drop them.  Call
+ * with load_mutex held, once the state's kit has been loaded. */
+static void apply_restored(DrMr* drmr, int loaded) {
+  int i;
+  if (!drmr->restore_gains) return;
+  for (i = 0;loaded && i < drmr->num_restore && i < drmr->num_samples;i++) {
+    drmr->coefs[i].gain = drmr->restore_gains[i];
+    drmr->coefs[i].pan = drmr->restore_pans[i];
+  }
+  for (i = 0;loaded && i < drmr->num_restore_outputs && i < drmr->num_samples;i++)
+    set_output(drmr->coefs+i,drmr->restore_outputs[i]);
+  free(drmr->restore_gains);
+  free(drmr->restore_pans);
+  free(drmr->restore_outputs);
+  drmr->restore_gains = drmr->restore_pans = NULL;
+  drmr->restore_outputs = NULL;
+  drmr->num_restore = drmr->num_restore_outputs = 0;
+  drmr->notify_all = 1;
+}
+
+// store slot of the kit channel ch plays now, -1 for none
+static int playing_kit(DrMr* drmr, int ch) {
+  int k,off;
+  if (drmr->chan_count[ch] == 0) return -1;
+  for (k = 0,off = 0;k < drmr->num_cur_kits;k++) {
+    if (off == drmr->chan_first[ch]) return drmr->cur_kits[k];
+    off += drmr->store[drmr->cur_kits[k]].num_samples;
+  }
+  return -1;
+}
+
+void drmr_use_kit(DrMr* drmr, drmr_sample* samples, int num_samples, int locked) {
+  drmr_use_channel_kit(drmr,0,samples,num_samples,locked);
+}
+
+void drmr_use_channel_kit(DrMr* drmr, int channel, drmr_sample* samples, int num_samples,
+			  int locked) {
+  int ch,k,slot,num_kits = 0,total;
+  int kits[DRMR_NUM_CHANNELS],pos[DRMR_NUM_CHANNELS],offset[DRMR_NUM_CHANNELS];
+  int first[DRMR_NUM_CHANNELS],count[DRMR_NUM_CHANNELS];
+  char own[DRMR_NUM_CHANNELS];
+  for (slot = 0;slot < DRMR_MAX_STORED && drmr->store[slot].path;slot++);
+  drmr->store[slot].path = strdup("");
+  drmr->store[slot].samples = samples;
+  drmr->store[slot].num_samples = num_samples;
+  drmr->store[slot].budget = 0;
+  drmr->store[slot].trim = TRIM_DEFAULT;
+  drmr->store[slot].normalize = NORMALIZE_OFF;
+  drmr->store[slot].locked = locked;
+  drmr->store[slot].refs = 1;
+  // the other channels keep playing what they were
+  for (ch = 0;ch < DRMR_NUM_CHANNELS;ch++) {
+    int want = -1;
+    own[ch] = ch == channel ? ch > 0 : ch > 0 && drmr->chan_own[ch];
+    pos[ch] = -1;
+    if (ch == channel || (channel == 0 && !own[ch]))
+      want = slot;
+    else
+      want = playing_kit(drmr,ch);
+    if (want < 0) continue;
+    for (k = 0;k < num_kits;k++)
+      if (kits[k] == want) break;
+    if (k == num_kits) {
+      kits[num_kits++] = want;
+      if (want != slot) drmr->store[want].refs++; // swap_kits() drops one
+    }
+    pos[ch] = k;
+  }
+  total = layout_kits(drmr,kits,num_kits,pos,offset,first,count);
+  swap_kits(drmr,kits,num_kits,offset,total,first,count,own);
+  drmr->req_lock = locked;
+  drmr->req_trim = TRIM_DEFAULT;
+  drmr->req_normalize = NORMALIZE_OFF;
+}
+
 static void* load_thread(void* arg) {
   DrMr* drmr = (DrMr*)arg;
-  drmr_sample *loaded_samples,*old_samples;
-  int loaded_count, old_scount;
+  uint32_t seen = 0, seen_kits = 0;
+  char paths[DRMR_NUM_CHANNELS][BUFSIZ];
   for(;;) {
+    int request,budget,trim,normalize,lock,threads,policy,prio,kits_seq,ch,k;
+    int chan_req[DRMR_NUM_CHANNELS];
+    int kits[DRMR_NUM_CHANNELS],num_kits = 0,chan_pos[DRMR_NUM_CHANNELS];
+    int offset[DRMR_NUM_CHANNELS],first[DRMR_NUM_CHANNELS],count[DRMR_NUM_CHANNELS];
+    int num_samples, kept = 0;
+    size_t used;
+    char own[DRMR_NUM_CHANNELS];
+    // only the latest request matters, anything posted while we were
+    // busy has been overwritten by the time we get here
     pthread_mutex_lock(&drmr->load_mutex);
-    pthread_cond_wait(&drmr->load_cond,
-		      &drmr->load_mutex);
+    while (drmr->req_seq == seen && !drmr->retired_done)
+      pthread_cond_wait(&drmr->load_cond,
+			&drmr->load_mutex);
+    seen = drmr->req_seq;
+    kits_seq = drmr->req_kit_seq;
+    request = drmr->req_kit;
+    budget = drmr->req_budget;
+    trim = drmr->req_trim;
+    normalize = drmr->req_normalize;
+    lock = drmr->req_lock;
+    threads = drmr->req_threads;
+    policy = drmr->req_policy;
+    prio = drmr->req_prio;
+    memcpy(paths[0],drmr->req_path,BUFSIZ);
+    memcpy(chan_req,drmr->req_chan_kit,sizeof(chan_req));
+    drmr->load_cancel = 0;
     pthread_mutex_unlock(&drmr->load_mutex); 
-    int request = (int)floorf(*(drmr->kitReq));
-    if (request == drmr->curKit) continue;
-    old_samples = drmr->samples;
-    old_scount = drmr->num_samples;
-    if (request < 0 || request >= drmr->kits->num_kits) {
-      pthread_mutex_lock(&drmr->load_mutex);
-      drmr->num_samples = 0;
-      drmr->samples = NULL;
-      pthread_mutex_unlock(&drmr->load_mutex); 
-    } else {
-      printf("loading kit: %i\n",request);
-      loaded_samples = load_hydrogen_kit(drmr->kits->kits[request].path,drmr->rate,&loaded_count);
-      // just lock for the critical moment when we swap in the new kit
-      pthread_mutex_lock(&drmr->load_mutex);
-      drmr->samples = loaded_samples;
-      drmr->num_samples = loaded_count;
-      pthread_mutex_unlock(&drmr->load_mutex); 
+    reclaim_retired(drmr);
+    if (threads-1 != drmr->running_helpers)
+      set_helpers(drmr,threads-1,policy,prio);
+    if (kits_seq == seen_kits) continue;
+
+    // work out which kit each channel wants, channel 1's is first
+    if (!paths[0][0])
+      kit_index_path(drmr,request,paths[0]);
+    else
+      request = -1;
+    for (ch = 1;ch < DRMR_NUM_CHANNELS;ch++)
+      kit_index_path(drmr,chan_req[ch],paths[ch]);
+    used = 0;
+    for (ch = 0;ch < DRMR_NUM_CHANNELS;ch++) {
+      char* path = (ch == 0 || chan_req[ch] < 0) ? paths[0] : paths[ch];
+      own[ch] = ch > 0 && chan_req[ch] >= 0;
+      chan_pos[ch] = -1;
+      if (ch > 0 && !own[ch]) {
+	chan_pos[ch] = chan_pos[0];
+	continue;
+      }
+      if (!path[0]) continue;
+      for (k = 0;k < num_kits;k++)
+	if (!strcmp(path,drmr->store[kits[k]].path)) break;
+      if (k == num_kits) {
+	/* the budget is for every kit the instance plays, each kit gets
+	 * what the ones before it left over */
+	int kit_budget = budget, slot;
+	if (budget > 0) {
+	  kit_budget = budget-(int)((used+1048575)/1048576);
+	  if (kit_budget <= 0) {
+	    fprintf(stderr,"Memory budget used up, not loading %s for channel %i\n",
+		    path,ch+1);
+	    continue;
+	  }
+	}
+	// kits that are already loaded are shared, not loaded again
+	slot = find_stored(drmr,path,kit_budget,trim,normalize);
+	if (slot < 0) slot = store_kit(drmr,path,kit_budget,trim,normalize,lock);
+	if (slot == -2) break;
+	if (slot == -1) {
+	  // a kit that can't be loaded (or doesn't fit the budget) doesn't
+	  // silence the channel, it keeps playing what it was
+	  if (ch == 0) kept = 1;
+	  slot = playing_kit(drmr,ch);
+	  if (slot < 0) continue;
+	  fprintf(stderr,"Channel %i keeps its current kit\n",ch+1);
+	  for (k = 0;k < num_kits && kits[k] != slot;k++);
+	}
+	if (k == num_kits) {
+	  kits[num_kits++] = slot;
+	  drmr->store[slot].refs++;
+	  used += kit_memory(drmr->store[slot].samples,drmr->store[slot].num_samples);
+	}
+      }
+      chan_pos[ch] = k;
+    }
+    if (ch < DRMR_NUM_CHANNELS) {
+      // cancelled, drop kits that only this request wanted
+      release_kits(drmr,kits,num_kits);
+      continue;
     }
-    if (old_scount > 0) free_samples(old_samples,old_scount);
-    drmr->curKit = request;
+    seen_kits = kits_seq;
+
+    for (k = 0;k < num_kits;k++)
+      if (drmr->store[kits[k]].locked != lock) {
+	lock_samples(drmr->store[kits[k]].samples,drmr->store[kits[k]].num_samples,lock);
+	drmr->store[kits[k]].locked = lock;
+      }
+    num_samples = layout_kits(drmr,kits,num_kits,chan_pos,offset,first,count);
+    if (num_kits == drmr->num_cur_kits &&
+	!memcmp(kits,drmr->cur_kits,num_kits*sizeof(int)) &&
+	!memcmp(first,drmr->chan_first,sizeof(first)) &&
+	!memcmp(count,drmr->chan_count,sizeof(count)) &&
+	!memcmp(own,drmr->chan_own,sizeof(own))) {
+      // same kits as we have, at most the lock setting changed
+      release_kits(drmr,kits,num_kits);
+    } else
+      swap_kits(drmr,kits,num_kits,offset,num_samples,first,count,own);
+    pthread_mutex_lock(&drmr->load_mutex);
+    if (!kept) memcpy(drmr->cur_path,paths[0],BUFSIZ);
+    drmr->notify_all = 1; // so UIs learn the kit's path
+    apply_restored(drmr,!kept);
+    pthread_mutex_unlock(&drmr->load_mutex);
+    if (!kept) drmr->curKit = request;
   }
   return 0;
 }
@@ -64,11 +804,72 @@ instantiate(const LV2_Descriptor*     descriptor,
             const LV2_Feature* const* features) {
   int i;
   DrMr* drmr = malloc(sizeof(DrMr));
-  drmr->map = NULL;
   drmr->samples = NULL;
+  drmr->coefs = NULL;
   drmr->num_samples = 0;
+  drmr->notify_all = 0;
+  drmr->restore_gains = drmr->restore_pans = NULL;
+  drmr->num_restore = 0;
+  drmr->restore_outputs = NULL;
+  drmr->num_restore_outputs = 0;
+  drmr->vel_curve = -1;
+  drmr->num_curve_points = 0;
+  drmr->velocity_curve = NULL;
+  drmr->control_port = NULL;
+  drmr->notify_port = NULL;
+  drmr->num_voices = 0;
+  drmr->block_voices = 0;
+  drmr->num_cur_kits = 0;
+  memset(drmr->store,0,sizeof(drmr->store));
+  for (i = 0;i < DRMR_NUM_CHANNELS;i++) {
+    drmr->chan_first[i] = drmr->chan_count[i] = 0;
+    drmr->chan_own[i] = 0;
+    drmr->chan_kit[i] = drmr->chan_base[i] = NULL;
+    drmr->req_chan_kit[i] = -1;
+  }
   drmr->curKit = -1;
+  drmr->req_kit = -1;
+  drmr->port_kit = -1;
+  drmr->req_path[0] = 0;
+  drmr->cur_path[0] = 0;
+  drmr->kits = NULL;
+  drmr->kit_watch = NULL;
+  drmr->urid_map = NULL;
+  drmr->req_budget = 0;
+  drmr->req_lock = 0;
+  drmr->req_trim = TRIM_DEFAULT;
+  drmr->req_normalize = NORMALIZE_OFF;
+  drmr->req_seq = 0;
+  drmr->req_kit_seq = 0;
+  drmr->load_cancel = 0;
+  drmr->kit_bytes = 0;
   drmr->rate = rate;
+  drmr->dsp_load = NULL;
+  drmr->active_voices = NULL;
+  drmr->peak_time = NULL;
+  drmr->mem_budget = NULL;
+  drmr->kit_memory = NULL;
+  drmr->lock_memory = NULL;
+  drmr->kit_fade = NULL;
+  drmr->render_threads = NULL;
+  drmr->trim = NULL;
+  drmr->normalize = NULL;
+  memset(drmr->retired,0,sizeof(drmr->retired));
+  drmr->num_retired_voices = 0;
+  drmr->retired_done = 0;
+  memset(drmr->helpers,0,sizeof(drmr->helpers));
+  drmr->num_helpers = 0;
+  drmr->running_helpers = 0;
+  drmr->job = 0;
+  drmr->job_frames = 0;
+  drmr->job_pos = 0;
+  drmr->busy = 0;
+  memset(drmr->claim,0,sizeof(drmr->claim));
+  drmr->par_backoff = 0;
+  drmr->req_threads = 1;
+  drmr->req_policy = SCHED_OTHER;
+  drmr->req_prio = 0;
+  memset(&drmr->stats,0,sizeof(drmr_stats));
 
   if (pthread_mutex_init(&drmr->load_mutex, 0)) {
     fprintf(stderr, "Could not initialize load_mutex.\n");
@@ -81,42 +882,45 @@ instantiate(const LV2_Descriptor*     descriptor,
     return 0;
   }
 
-  // Map midi uri
+  // Map uris
   while(*features) {
-    if (!strcmp((*features)->URI, LV2_URI_MAP_URI)) {
-      drmr->map = (LV2_URI_Map_Feature *)((*features)->data);
-      drmr->uris.midi_event = drmr->map->uri_to_id
-	(drmr->map->callback_data,
-	 "http://lv2plug.in/ns/ext/event",
-	 "http://lv2plug.in/ns/ext/midi#MidiEvent");
+    if (!strcmp((*features)->URI, LV2_URID_MAP_URI)) {
+      LV2_URID_Map* um = (LV2_URID_Map *)((*features)->data);
+      drmr->urid_map = um;
+      drmr->uris.midi_event = um->map(um->handle,LV2_MIDI__MidiEvent);
+      drmr->uris.kit_path = um->map(um->handle,DRMR_URI "#kitPath");
+      drmr->uris.atom_path = um->map(um->handle,LV2_ATOM__Path);
+      drmr->uris.atom_vector = um->map(um->handle,LV2_ATOM__Vector);
+      drmr->uris.patch_get = um->map(um->handle,LV2_PATCH__Get);
+      drmr->uris.patch_set = um->map(um->handle,LV2_PATCH__Set);
+      drmr->uris.patch_property = um->map(um->handle,LV2_PATCH__property);
+      drmr->uris.patch_value = um->map(um->handle,LV2_PATCH__value);
+      drmr->uris.instrument = um->map(um->handle,DRMR_URI "#instrument");
+      drmr->uris.gain = um->map(um->handle,DRMR_URI "#gain");
+      drmr->uris.pan = um->map(um->handle,DRMR_URI "#pan");
+      drmr->uris.output = um->map(um->handle,DRMR_URI "#output");
+      drmr->uris.velocity_curve = um->map(um->handle,DRMR_URI "#velocityCurve");
+      drmr->uris.block_times = um->map(um->handle,DRMR_URI "#blockTimes");
+      drmr->uris.active_voices = um->map(um->handle,DRMR_URI "#activeVoices");
+      lv2_atom_forge_init(&drmr->forge,um);
     }
     features++;
   }
-  if (!drmr->map) {
-    fprintf(stderr, "LV2 host does not support uri-map.\n");
+  if (!drmr->urid_map) {
+    fprintf(stderr, "LV2 host does not support urid:map.\n");
     free(drmr);
     return 0;
   }
   
-  drmr->kits = scan_kits();
-  if (!drmr->kits) {
-    fprintf(stderr, "No drum kits found\n");
-    free(drmr);
-    return 0;
-  }
-
   if (pthread_create(&drmr->load_thread, 0, load_thread, drmr)) {
     fprintf(stderr, "Could not initialize loading thread.\n");
     free(drmr);
     return 0;
   }
 
-  drmr->gains = malloc(32*sizeof(float*));
-  drmr->pans = malloc(32*sizeof(float*));
-  for(i = 0;i<32;i++) {
-    drmr->gains[i] = NULL;
-    drmr->pans[i] = NULL;
-  }
+  for (i = 0;i <= DRMR_NUM_BUSES;i++)
+    drmr->left[i] = drmr->right[i] = NULL;
+  init_db_table();
 
   return (LV2_Handle)drmr;
 }
@@ -129,13 +933,19 @@ connect_port(LV2_Handle instance,
   DrMrPortIndex port_index = (DrMrPortIndex)port;
   switch (port_index) {
   case DRMR_MIDI:
-    drmr->midi_port = (LV2_Event_Buffer*)data;
+    drmr->midi_port = (const LV2_Atom_Sequence*)data;
     break;
   case DRMR_LEFT:
-    drmr->left = (float*)data;
+    drmr->left[0] = (float*)data;
     break;
   case DRMR_RIGHT:
-    drmr->right = (float*)data;
+    drmr->right[0] = (float*)data;
+    break;
+  case DRMR_CONTROL:
+    drmr->control_port = (const LV2_Atom_Sequence*)data;
+    break;
+  case DRMR_NOTIFY:
+    drmr->notify_port = (LV2_Atom_Sequence*)data;
     break;
   case DRMR_KITNUM:
     if(data) drmr->kitReq = (float*)data;
@@ -149,25 +959,63 @@ connect_port(LV2_Handle instance,
   case DRMR_IGNORE_NOTE_OFF:
     if (data) drmr->ignore_note_off = (float*)data;
     break;
+  case DRMR_DSP_LOAD:
+    drmr->dsp_load = (float*)data;
+    break;
+  case DRMR_ACTIVE_VOICES:
+    drmr->active_voices = (float*)data;
+    break;
+  case DRMR_PEAK_TIME:
+    drmr->peak_time = (float*)data;
+    break;
+  case DRMR_MEM_BUDGET:
+    drmr->mem_budget = (float*)data;
+    break;
+  case DRMR_KIT_MEMORY:
+    drmr->kit_memory = (float*)data;
+    break;
+  case DRMR_LOCK_MEMORY:
+    drmr->lock_memory = (float*)data;
+    break;
+  case DRMR_KIT_FADE:
+    drmr->kit_fade = (float*)data;
+    break;
+  case DRMR_RENDER_THREADS:
+    drmr->render_threads = (float*)data;
+    break;
+  case DRMR_TRIM:
+    drmr->trim = (float*)data;
+    break;
+  case DRMR_NORMALIZE:
+    drmr->normalize = (float*)data;
+    break;
+  case DRMR_VELOCITY_CURVE:
+    drmr->velocity_curve = (float*)data;
+    break;
   default:
     break;
   }
 
-  if (port_index >= DRMR_GAIN_ONE && port_index <= DRMR_GAIN_THIRTYTWO) {
-    int goff = port_index - DRMR_GAIN_ONE;
-    drmr->gains[goff] = (float*)data;
+  if (port_index >= DRMR_BUS_ONE_LEFT && port_index <= DRMR_BUS_EIGHT_RIGHT) {
+    int boff = port_index - DRMR_BUS_ONE_LEFT;
+    if (boff & 1)
+      drmr->right[boff/2+1] = (float*)data;
+    else
+      drmr->left[boff/2+1] = (float*)data;
   }
 
-  if (port_index >= DRMR_PAN_ONE && port_index <= DRMR_PAN_THIRTYTWO) {
-    int poff = port_index - DRMR_PAN_ONE;
-    drmr->pans[poff] = (float*)data;
-  }
+  if (port_index >= DRMR_CHAN_KIT_TWO && port_index <= DRMR_CHAN_KIT_SIXTEEN)
+    drmr->chan_kit[port_index-DRMR_CHAN_KIT_TWO+1] = (float*)data;
+
+  if (port_index >= DRMR_CHAN_BASENOTE_TWO && port_index <= DRMR_CHAN_BASENOTE_SIXTEEN)
+    drmr->chan_base[port_index-DRMR_CHAN_BASENOTE_TWO+1] = (float*)data;
 }
 
-static inline void layer_to_sample(drmr_sample *sample, float gain) {
+static inline void layer_to_sample(drmr_sample *sample, float gain, float level) {
   int i;
   float mapped_gain = (1-(gain/GAIN_MIN));
   if (mapped_gain > 1.0f) mapped_gain = 1.0f;
+  mapped_gain *= level;
   for(i = 0;i < sample->layer_count;i++) {
     if (sample->layers[i].min <= mapped_gain &&
 	(sample->layers[i].max > mapped_gain ||
@@ -186,145 +1034,919 @@ static inline void layer_to_sample(drmr_sample *sample, float gain) {
   sample->data = sample->layers[0].data;
 }
 
-static inline void trigger_sample(DrMr *drmr, int nn, uint8_t* const data) {
-  // need to mutex this to avoid getting the samples array
-  // changed after the check that the midi-note is valid
-  int ignvel = (int)floorf(*(drmr->ignore_velocity));
-  pthread_mutex_lock(&drmr->load_mutex);
-  if (nn >= 0 && nn < drmr->num_samples) {
-    if (drmr->samples[nn].layer_count > 0) {
-      layer_to_sample(drmr->samples+nn,*(drmr->gains[nn]));
-      if (drmr->samples[nn].limit == 0)
-	fprintf(stderr,"Failed to find layer at: %i for %f\n",nn,*drmr->gains[nn]);
-    }
-    drmr->samples[nn].active = 1;
-    drmr->samples[nn].offset = 0;
-    drmr->samples[nn].velocity = ignvel?1.0:((float)data[2])/VELOCITY_MAX;
+// remove the voice at position v in the active list
+static inline void remove_voice(DrMr *drmr, int v) {
+  drmr->voices[v] = drmr->voices[--drmr->num_voices];
+}
+
+/* The sample a note on a midi channel plays, -1 if none.  Channels
+ * with their own kit have their own base note.  Call with load_mutex
+ * held, the mapping changes along with the kits. */
+static inline int note_to_sample(DrMr *drmr, int channel, int note) {
+  int nn;
+  if (drmr->chan_own[channel] && drmr->chan_base[channel])
+    nn = note-(int)floorf(*(drmr->chan_base[channel]));
+  else
+    nn = note-(int)floorf(*(drmr->baseNote));
+  if (nn < 0 || nn >= drmr->chan_count[channel]) return -1;
+  return drmr->chan_first[channel]+nn;
+}
+
+// layer choice goes by the gain of the sample, and the velocity
+static inline float sample_gain(DrMr *drmr, int nn) {
+  return drmr->coefs[nn].gain;
+}
+
+/* Start the sample, or restart it if it was playing.  level is the
+ * note's velocity after the curve, 0 to 1.  Call with load_mutex
+ * held. */
+static inline void trigger_sample(DrMr *drmr, int nn, float level) {
+  drmr_sample* cs = drmr->samples+nn;
+  if (cs->layer_count > 0) {
+    layer_to_sample(cs,sample_gain(drmr,nn),level);
+    if (cs->limit == 0)
+      fprintf(stderr,"Failed to find layer at: %i for %f\n",nn,sample_gain(drmr,nn));
   }
-  pthread_mutex_unlock(&drmr->load_mutex);
+  cs->kernel = pick_kernel(cs);
+  if (!cs->active) {
+    drmr->voices[drmr->num_voices++] = nn;
+    drmr->block_voices++;
+  }
+  cs->active = 1;
+  cs->offset = 0;
+  cs->velocity = level;
 }
 
+/* Stop the sample.  A gain ramp it was in the middle of is dropped,
+ * its coefficients are recomputed when it's next triggered.  Call with
+ * load_mutex held. */
 static inline void untrigger_sample(DrMr *drmr, int nn) {
-  pthread_mutex_lock(&drmr->load_mutex);
-  if (nn >= 0 && nn < drmr->num_samples) {
-    if (drmr->samples[nn].layer_count > 0) {
-      layer_to_sample(drmr->samples+nn,*(drmr->gains[nn]));
-      if (drmr->samples[nn].limit == 0)
-	fprintf(stderr,"Failed to find layer at: %i for %f\n",nn,*drmr->gains[nn]);
+  drmr_sample* cs = drmr->samples+nn;
+  drmr_coef* co = drmr->coefs+nn;
+  co->left_step = co->right_step = 0.0f;
+  co->coef_gain = NAN;
+  if (cs->active) {
+    int v;
+    for (v = 0;v < drmr->num_voices;v++)
+      if (drmr->voices[v] == nn) {
+	remove_voice(drmr,v);
+	break;
+      }
+  }
+  cs->active = 0;
+  cs->offset = 0;
+}
+
+/* Decode the block's midi into drmr->triggers.  Only note on and off
+ * are kept, clock, controllers, sysex and the rest all fail the one
+ * status test.  Notes are mapped to samples here, so call with
+ * load_mutex held. */
+static void decode_midi(DrMr *drmr, uint32_t n_samples, int ignno) {
+  uint32_t last = 0;
+  drmr->num_triggers = 0;
+  if (!drmr->midi_port) return;
+  LV2_ATOM_SEQUENCE_FOREACH(drmr->midi_port,ev) {
+    const uint8_t* data = (const uint8_t*)(ev+1);
+    drmr_trigger* t;
+    int nn,vel;
+    if (ev->body.type != drmr->uris.midi_event || ev->body.size < 3 ||
+	(data[0] & 0xe0) != 0x80)
+      continue;
+    // a note on with velocity 0 is a note off
+    vel = (data[0] & 0xf0) == 0x90 ? data[2] & 0x7f : 0;
+    if (vel == 0 && ignno) continue;
+    nn = note_to_sample(drmr,data[0] & 15,data[1] & 0x7f);
+    if (nn < 0 || drmr->num_triggers == DRMR_MAX_TRIGGERS) continue;
+    t = drmr->triggers+drmr->num_triggers++;
+    // hosts should send events in order, don't let one that doesn't
+    // unsort the queue
+    t->offset = ev->time.frames > (int64_t)last ? (uint32_t)ev->time.frames : last;
+    if (t->offset >= n_samples) t->offset = n_samples > 0 ? n_samples-1 : 0;
+    last = t->offset;
+    t->sample = nn;
+    t->velocity = vel;
+  }
+}
+
+/* Start and stop the voices for the queued notes from the i'th up to
+ * frame pos, returning the index of the first one left.  Call with
+ * load_mutex held. */
+static int play_triggers(DrMr *drmr, int i, uint32_t pos) {
+  for (;i < drmr->num_triggers && drmr->triggers[i].offset <= pos;i++) {
+    const drmr_trigger* t = drmr->triggers+i;
+    if (t->velocity > 0)
+      trigger_sample(drmr,t->sample,drmr->vel_table[t->velocity]);
+    else
+      untrigger_sample(drmr,t->sample);
+  }
+  return i;
+}
+
+/* Recompute the cached coefficients of sample i if its gain or pan
+ * changed since they were last computed.  If the sample is already
+ * sounding the change is spread from frame pos to the end of the
+ * block as a linear ramp to avoid zipper noise, otherwise the new
+ * value is used right away. */
+static void update_coef(DrMr *drmr, int i, uint32_t pos, uint32_t n_samples) {
+  drmr_coef* co = drmr->coefs+i;
+  drmr_sample* cs = drmr->samples+i;
+  float g = co->gain;
+  float p = co->pan;
+  if (g != co->coef_gain || p != co->coef_pan) {
+    float gain = db_to_coef(g);
+    float pan_right = (p+1)/2.0f;
+    float pan_left = 1-pan_right;
+    float right = (pan_right * (DB3SCALE * pan_right + DB3SCALEPO))*gain;
+    float left = (pan_left * (DB3SCALE * pan_left + DB3SCALEPO))*gain;
+    if (cs->active && cs->offset > 0 && pos < n_samples &&
+	co->coef_gain == co->coef_gain) { // nan means we've never set these
+      // from where an earlier ramp this block has got to by pos
+      float cur_left = co->left+co->left_step*pos;
+      float cur_right = co->right+co->right_step*pos;
+      co->left_step = (left-cur_left)/(n_samples-pos);
+      co->right_step = (right-cur_right)/(n_samples-pos);
+      co->left = cur_left-co->left_step*pos;
+      co->right = cur_right-co->right_step*pos;
+    } else {
+      co->left = left;
+      co->right = right;
+      co->left_step = co->right_step = 0.0f;
     }
-    drmr->samples[nn].active = 0;
-    drmr->samples[nn].offset = 0;
+    co->coef_gain = g;
+    co->coef_pan = p;
   }
-  pthread_mutex_unlock(&drmr->load_mutex);
 }
 
-#define DB3SCALE -0.8317830986718104f
-#define DB3SCALEPO 1.8317830986718104f
-// taken from lv2 example amp plugin
-#define DB_CO(g) ((g) > GAIN_MIN ? powf(10.0f, (g) * 0.05f) : 0.0f)
+/* Update the coefficients of every playing sample from frame pos.
+ * Idle samples are picked up when they are next triggered. */
+static void update_coefs(DrMr *drmr, uint32_t pos, uint32_t n_samples) {
+  int v;
+  for (v = 0;v < drmr->num_voices;v++)
+    update_coef(drmr,drmr->voices[v],pos,n_samples);
+}
 
-static void run(LV2_Handle instance, uint32_t n_samples) {
-  int i,kitInt,baseNote,ignno;
-  DrMr* drmr = (DrMr*)instance;
+/* Land any ramps started by update_coefs on their target values.  Call
+ * before finished voices are removed, ramps are only started on voices. */
+static void finish_coef_ramps(DrMr *drmr, uint32_t n_samples) {
+  int v;
+  for (v = 0;v < drmr->num_voices;v++) {
+    drmr_coef* co = drmr->coefs+drmr->voices[v];
+    if (co->left_step != 0.0f || co->right_step != 0.0f) {
+      co->left += co->left_step*n_samples;
+      co->right += co->right_step*n_samples;
+      co->left_step = co->right_step = 0.0f;
+    }
+  }
+}
 
-  kitInt = (int)floorf(*(drmr->kitReq));
-  baseNote = (int)floorf(*(drmr->baseNote));
-  ignno = (int)floorf(*(drmr->ignore_note_off));
+/* Play the voices left over from kits that have been swapped out.
+ * They keep the gain, pan and output they had, and if a fade time was set
+ * are faded out over it.  Once a retired kit has no voices left the
+ * loader thread is woken to free it.  Call with load_mutex held. */
+static void run_retired(DrMr *drmr, uint32_t n_samples) {
+  int r,v,i;
+  drmr->num_retired_voices = 0;
+  for (r = 0;r < DRMR_MAX_RETIRED;r++) {
+    drmr_retired_kit* rk = drmr->retired+r;
+    float fade = 1.0f, fade_step = 0.0f;
+    if (!rk->samples) continue;
+    drmr->block_voices += rk->num_voices;
+    if (rk->fade_len > 0) {
+      uint32_t left = rk->fade_left > n_samples ? rk->fade_left-n_samples : 0;
+      fade = (float)rk->fade_left/rk->fade_len;
+      fade_step = ((float)left/rk->fade_len-fade)/n_samples;
+      rk->fade_left = left;
+    }
+    for (v = 0;v < rk->num_voices;) {
+      drmr_sample* cs;
+      float left,right;
+      int b;
+      i = rk->voices[v];
+      cs = rk->samples+i;
+      b = rk->coefs[i].output;
+      if (!drmr->left[b] || !drmr->right[b]) b = 0;
+      left = rk->coefs[i].left*cs->velocity;
+      right = rk->coefs[i].right*cs->velocity;
+      cs->kernel->mix[rk->fade_len > 0](drmr->left[b],drmr->right[b],cs,
+					 left*fade,right*fade,
+					 left*fade_step,right*fade_step,n_samples);
+      if (cs->offset >= cs->limit || (rk->fade_len > 0 && rk->fade_left == 0)) {
+	cs->active = 0;
+	rk->voices[v] = rk->voices[--rk->num_voices];
+      }
+      else
+	v++;
+    }
+    if (rk->num_voices == 0) { // wake the loader to free it
+      drmr->retired_done = 1;
+      pthread_cond_signal(&drmr->load_cond);
+    }
+    drmr->num_retired_voices += rk->num_voices;
+  }
+}
 
-  if (kitInt != drmr->curKit) // requested a new kit
-    pthread_cond_signal(&drmr->load_cond);
+/* Hand the loader the kits in req_kit/req_path and req_chan_kit with
+ * the given budget, trim, normalize and lock settings.  There is only ever
+ * one pending request: a newer one replaces it, and cancels a load
+ * that is still in progress, so sweeping the kit control only loads
+ * the kit it ends up on.  Call with load_mutex held. */
+static void post_load_request(DrMr *drmr, int budget, int trim, int normalize, int lock) {
+  drmr->req_budget = budget;
+  drmr->req_trim = trim;
+  drmr->req_normalize = normalize;
+  drmr->req_lock = lock;
+  drmr->req_seq++;
+  drmr->req_kit_seq++;
+  drmr->load_cancel = 1;
+  pthread_cond_signal(&drmr->load_cond);
+}
 
-  LV2_Event_Iterator eit;
-  if (drmr->midi_port && lv2_event_begin(&eit,drmr->midi_port)) { // if we have any events
-    LV2_Event *cur_ev;
-    uint8_t nn;
-    uint8_t* data;
-    while (lv2_event_is_valid(&eit)) {
-      cur_ev = lv2_event_get(&eit,&data);
-      if (cur_ev->type == drmr->uris.midi_event) {
-	//int channel = *data & 15;
-	switch ((*data) >> 4) {
-	case 8:
-	  if (!ignno) {
-	    nn = data[1];
-	    nn-=baseNote;
-	    untrigger_sample(drmr,nn);
-	  }
-	  break;
-	case 9: {
-	  nn = data[1];
-	  nn-=baseNote;
-	  trigger_sample(drmr,nn,data);
-	  break;
-	}
-	default:
-	  printf("Unhandeled status: %i\n",(*data)>>4);
-	}
-      } else printf("unrecognized event\n");
-      lv2_event_increment(&eit);
-    } 
+static inline float clamp_param(float v, float lo, float hi) {
+  return v > hi ? hi : (v >= lo ? v : lo); // nan ends up at lo
+}
+
+static inline void set_coef(drmr_coef* co, int is_gain, float v) {
+  if (is_gain)
+    co->gain = clamp_param(v,GAIN_MIN,GAIN_MAX);
+  else
+    co->pan = clamp_param(v,-1.0f,1.0f);
+}
+
+// level of velocity v under the user points, flat beyond the ends
+static float curve_point_level(DrMr *drmr, float v) {
+  const float* pts = drmr->curve_points;
+  int p, n = drmr->num_curve_points;
+  if (v <= pts[0]) return pts[1];
+  for (p = 1;p < n;p++)
+    if (v <= pts[2*p]) {
+      float x0 = pts[2*p-2], y0 = pts[2*p-1];
+      if (pts[2*p] == x0) return pts[2*p+1];
+      return y0+(pts[2*p+1]-y0)*(v-x0)/(pts[2*p]-x0);
+    }
+  return pts[2*n-1];
+}
+
+/* Compile the velocity curve into drmr->vel_table, so a note's level
+ * is one lookup.  VELOCITY_USER without points is linear.  Call with
+ * load_mutex held, the points are changed under it. */
+static void build_velocity_table(DrMr *drmr, int curve) {
+  int v;
+  drmr->vel_table[0] = 0.0f;
+  for (v = 1;v <= VELOCITY_MAX;v++) {
+    float x = (float)v/VELOCITY_MAX, y;
+    if (curve == VELOCITY_LOG)
+      y = log1pf(VELOCITY_CURVE_K*x)/log1pf(VELOCITY_CURVE_K);
+    else if (curve == VELOCITY_EXP)
+      y = expm1f(VELOCITY_CURVE_K*x)/expm1f(VELOCITY_CURVE_K);
+    else if (curve == VELOCITY_FIXED)
+      y = 1.0f;
+    else if (curve == VELOCITY_USER && drmr->num_curve_points > 0)
+      y = curve_point_level(drmr,v);
+    else
+      y = x;
+    drmr->vel_table[v] = clamp_param(y,0.0f,1.0f);
   }
+  drmr->vel_curve = curve;
+}
 
-  for(i = 0;i<n_samples;i++) {
-    drmr->left[i] = 0.0f;
-    drmr->right[i] = 0.0f;
+/* Set the user curve from a vector of velocity,level pairs, returns 0
+ * if there are too many.  If the user curve is the one playing its
+ * table is rebuilt right away, so notes after a change mid-block use
+ * it.  Call with load_mutex held. */
+static int set_curve_points(DrMr *drmr, const float* vals, int n) {
+  float* pts = drmr->curve_points;
+  int i,j;
+  n /= 2;
+  if (n > DRMR_MAX_CURVE_POINTS) return 0;
+  for (i = 0;i < n;i++) {
+    float x = clamp_param(vals[2*i],0.0f,VELOCITY_MAX);
+    float y = clamp_param(vals[2*i+1],0.0f,1.0f);
+    // insertion sort by velocity, there are only a few
+    for (j = i;j > 0 && pts[2*j-2] > x;j--) {
+      pts[2*j] = pts[2*j-2];
+      pts[2*j+1] = pts[2*j-1];
+    }
+    pts[2*j] = x;
+    pts[2*j+1] = y;
   }
+  drmr->num_curve_points = n;
+  if (drmr->vel_curve == VELOCITY_USER)
+    build_velocity_table(drmr,VELOCITY_USER);
+  return 1;
+}
 
-  pthread_mutex_lock(&drmr->load_mutex); 
+/* The elements of an atom:Vector of floats or ints (child_type), NULL
+ * if value isn't one. */
+static const void* atom_vector(DrMr *drmr, const LV2_Atom* value, LV2_URID child_type,
+			       int* n) {
+  const LV2_Atom_Vector* vec = (const LV2_Atom_Vector*)value;
+  if (value->type != drmr->forge.Vector || vec->body.child_type != child_type ||
+      vec->body.child_size != sizeof(float))
+    return NULL;
+  *n = (vec->atom.size-sizeof(LV2_Atom_Vector_Body))/sizeof(float);
+  return vec+1;
+}
+
+/* Apply a patch:Set of the gain, pan or output of the sample given by
+ * its drmr:instrument.  Without an instrument the value is a vector of
+ * floats (ints for outputs), one per sample.  drmr:velocityCurve sets the points of the
+ * user velocity curve, a vector of velocity,level pairs.  drmr:kitPath
+ * loads the kit at that path, like a state restore.  Returns 1 if the
+ * message was for us.  Call with load_mutex held. */
+static int set_param(DrMr *drmr, const LV2_Atom_Object* obj) {
+  const LV2_Atom *property = NULL, *value = NULL, *inst = NULL;
+  LV2_URID prop;
+  int i;
+  lv2_atom_object_get(obj,
+		      drmr->uris.patch_property,&property,
+		      drmr->uris.patch_value,&value,
+		      drmr->uris.instrument,&inst,
+		      0);
+  if (!property || !value || property->type != drmr->forge.URID) return 0;
+  prop = ((const LV2_Atom_URID*)property)->body;
+  if (prop == drmr->uris.velocity_curve) {
+    const float* vals = atom_vector(drmr,value,drmr->forge.Float,&i);
+    return vals ? set_curve_points(drmr,vals,i) : 0;
+  }
+  if (prop == drmr->uris.kit_path) {
+    const char* path = (const char*)LV2_ATOM_BODY_CONST(value);
+    if (value->type != drmr->uris.atom_path || value->size < 2 ||
+	value->size > BUFSIZ || path[value->size-1])
+      return 0;
+    memcpy(drmr->req_path,path,value->size);
+    drmr->req_kit = -1;
+    // the index port still holds the old kit, don't load it again
+    drmr->port_kit = KIT_PORT_RESYNC;
+    post_load_request(drmr,drmr->req_budget,drmr->req_trim,drmr->req_normalize,
+		      drmr->req_lock);
+    return 1;
+  }
+  if (prop == drmr->uris.output) {
+    if (inst) {
+      if (inst->type != drmr->forge.Int || value->type != drmr->forge.Int) return 0;
+      i = ((const LV2_Atom_Int*)inst)->body;
+      if (i < 0 || i >= drmr->num_samples) return 0;
+      set_output(drmr->coefs+i,((const LV2_Atom_Int*)value)->body);
+    } else {
+      int n;
+      const int32_t* vals = atom_vector(drmr,value,drmr->forge.Int,&n);
+      if (!vals) return 0;
+      for (i = 0;i < n && i < drmr->num_samples;i++)
+	set_output(drmr->coefs+i,vals[i]);
+    }
+    return 1;
+  }
+  if (prop != drmr->uris.gain && prop != drmr->uris.pan) return 0;
+  if (inst) {
+    if (inst->type != drmr->forge.Int || value->type != drmr->forge.Float) return 0;
+    i = ((const LV2_Atom_Int*)inst)->body;
+    if (i < 0 || i >= drmr->num_samples) return 0;
+    set_coef(drmr->coefs+i,prop == drmr->uris.gain,((const LV2_Atom_Float*)value)->body);
+  } else {
+    int n;
+    const float* vals = atom_vector(drmr,value,drmr->forge.Float,&n);
+    if (!vals) return 0;
+    for (i = 0;i < n && i < drmr->num_samples;i++)
+      set_coef(drmr->coefs+i,prop == drmr->uris.gain,vals[i]);
+  }
+  return 1;
+}
+
+// write a patch:Set of the gain, pan or output of every sample, as one vector
+static void forge_params(DrMr *drmr, LV2_URID prop, uint32_t frame) {
+  LV2_Atom_Forge* forge = &drmr->forge;
+  LV2_Atom_Forge_Frame obj,vec;
+  int i;
+  lv2_atom_forge_frame_time(forge,frame);
+  lv2_atom_forge_object(forge,&obj,0,drmr->uris.patch_set);
+  lv2_atom_forge_key(forge,drmr->uris.patch_property);
+  lv2_atom_forge_urid(forge,prop);
+  lv2_atom_forge_key(forge,drmr->uris.patch_value);
+  lv2_atom_forge_vector_head(forge,&vec,sizeof(float),
+			     prop == drmr->uris.output ? forge->Int : forge->Float);
   for (i = 0;i < drmr->num_samples;i++) {
-    int pos,lim;
-    drmr_sample* cs = drmr->samples+i;
-    if (cs->active && (cs->limit > 0)) {
-      float coef_right, coef_left;
-      if (i < 32) {
-	float gain = DB_CO(*(drmr->gains[i]));
-	float pan_right = ((*drmr->pans[i])+1)/2.0f;
-	float pan_left = 1-pan_right;
-	coef_right = (pan_right * (DB3SCALE * pan_right + DB3SCALEPO))*gain*cs->velocity;
-	coef_left = (pan_left * (DB3SCALE * pan_left + DB3SCALEPO))*gain*cs->velocity;
-      }
-      else {
-	coef_right = coef_left = 1.0f;
+    if (prop == drmr->uris.output) {
+      int32_t b = drmr->coefs[i].output;
+      lv2_atom_forge_raw(forge,&b,sizeof(int32_t));
+    } else {
+      float v = prop == drmr->uris.gain ? drmr->coefs[i].gain : drmr->coefs[i].pan;
+      lv2_atom_forge_raw(forge,&v,sizeof(float));
+    }
+  }
+  lv2_atom_forge_pad(forge,drmr->num_samples*sizeof(float));
+  lv2_atom_forge_pop(forge,&vec);
+  lv2_atom_forge_pop(forge,&obj);
+}
+
+// write a patch:Set of one of the stats histograms, as a vector of ints
+static void forge_hist(DrMr *drmr, LV2_URID prop, const uint32_t* hist, int n,
+		       uint32_t frame) {
+  LV2_Atom_Forge* forge = &drmr->forge;
+  LV2_Atom_Forge_Frame obj;
+  lv2_atom_forge_frame_time(forge,frame);
+  lv2_atom_forge_object(forge,&obj,0,drmr->uris.patch_set);
+  lv2_atom_forge_key(forge,drmr->uris.patch_property);
+  lv2_atom_forge_urid(forge,prop);
+  lv2_atom_forge_key(forge,drmr->uris.patch_value);
+  lv2_atom_forge_vector(forge,sizeof(int32_t),forge->Int,n,hist);
+  lv2_atom_forge_pop(forge,&obj);
+}
+
+// skip to the next patch:Set on the control port from ev
+static const LV2_Atom_Event* find_param(DrMr *drmr, const LV2_Atom_Event* ev) {
+  const LV2_Atom_Sequence* seq = drmr->control_port;
+  for (;!lv2_atom_sequence_is_end(&seq->body,seq->atom.size,ev);
+       ev = lv2_atom_sequence_next(ev))
+    if ((ev->body.type == drmr->forge.Object || ev->body.type == drmr->forge.Blank) &&
+	((const LV2_Atom_Object*)&ev->body)->body.otype == drmr->uris.patch_set)
+      return ev;
+  return NULL;
+}
+
+/* Start the block's messages.  The notify port is opened for writing,
+ * a patch:Get on the control port has every gain and pan sent at the
+ * end of the block, and the patch:Sets are left in the control port's
+ * sequence for apply_params() to work through at their frames.  Call
+ * with load_mutex held. */
+static void handle_messages(DrMr *drmr) {
+  LV2_Atom_Forge* forge = &drmr->forge;
+  if (drmr->notify_port) {
+    lv2_atom_forge_set_buffer(forge,(uint8_t*)drmr->notify_port,
+			      drmr->notify_port->atom.size);
+    lv2_atom_forge_sequence_head(forge,&drmr->notify_seq,0);
+  }
+  drmr->next_param = NULL;
+  if (!drmr->control_port) return;
+  LV2_ATOM_SEQUENCE_FOREACH(drmr->control_port,ev) {
+    const LV2_Atom_Object* obj = (const LV2_Atom_Object*)&ev->body;
+    if ((ev->body.type == forge->Object || ev->body.type == forge->Blank) &&
+	obj->body.otype == drmr->uris.patch_get)
+      drmr->notify_all = 1;
+  }
+  drmr->next_param = find_param(drmr,lv2_atom_sequence_begin(&drmr->control_port->body));
+}
+
+// frame of the next patch:Set, n_samples if there are none left
+static inline uint32_t next_param_frame(DrMr *drmr, uint32_t n_samples) {
+  const LV2_Atom_Event* ev = drmr->next_param;
+  if (!ev || ev->time.frames >= (int64_t)n_samples) return n_samples;
+  return ev->time.frames > 0 ? (uint32_t)ev->time.frames : 0;
+}
+
+/* Apply the patch:Sets up to frame pos.  Each one the plugin takes is
+ * passed on to the notify port at its frame, so UIs see changes the
+ * host makes, and playing samples ramp to the new gains and pans from
+ * pos.  Hosts should send events in order, one that doesn't is just
+ * applied late.  Call with load_mutex held. */
+static void apply_params(DrMr *drmr, uint32_t pos, uint32_t n_samples) {
+  LV2_Atom_Forge* forge = &drmr->forge;
+  int applied = 0;
+  while (drmr->next_param && next_param_frame(drmr,n_samples) <= pos) {
+    const LV2_Atom_Event* ev = drmr->next_param;
+    uint32_t frame = next_param_frame(drmr,n_samples);
+    if (set_param(drmr,(const LV2_Atom_Object*)&ev->body)) {
+      applied = 1;
+      if (drmr->notify_port) {
+	lv2_atom_forge_frame_time(forge,frame < n_samples ? frame : (n_samples ? n_samples-1 : 0));
+	lv2_atom_forge_write(forge,&ev->body,sizeof(LV2_Atom)+ev->body.size);
       }
+    }
+    drmr->next_param = find_param(drmr,lv2_atom_sequence_next(ev));
+  }
+  if (applied)
+    update_coefs(drmr,pos,n_samples);
+}
 
-      if (cs->info->channels == 1) { // play mono sample
-	lim = (n_samples < (cs->limit - cs->offset)?n_samples:(cs->limit-cs->offset));
-	for(pos = 0;pos < lim;pos++) {
-	  drmr->left[pos]  += cs->data[cs->offset]*coef_left;
-	  drmr->right[pos] += cs->data[cs->offset]*coef_right;
-	  cs->offset++;
-	}
-      } else { // play stereo sample
-	lim = (cs->limit-cs->offset)/cs->info->channels;
-	if (lim > n_samples) lim = n_samples;
-	for (pos=0;pos<lim;pos++) {
-	  drmr->left[pos]  += cs->data[cs->offset++]*coef_left;
-	  drmr->right[pos] += cs->data[cs->offset++]*coef_right;
+/* End the block's messages.  The kit's path and every gain, pan and
+ * output, if they were asked for or a kit changed, and after each stats window
+ * the histograms, go out on the notify port after the echoed
+ * patch:Sets, and the port is closed.  Call with load_mutex held. */
+static void finish_messages(DrMr *drmr, uint32_t n_samples) {
+  LV2_Atom_Forge* forge = &drmr->forge;
+  uint32_t last = n_samples > 0 ? n_samples-1 : 0;
+  int notify = drmr->notify_port != NULL;
+  uint32_t path_len = strlen(drmr->cur_path);
+  // path and three vectors plus their headers, if they don't fit try next block
+  if (notify && drmr->notify_all &&
+      forge->size-forge->offset >= 3*(drmr->num_samples*sizeof(float)+128)+path_len+128) {
+    if (path_len) {
+      LV2_Atom_Forge_Frame obj;
+      lv2_atom_forge_frame_time(forge,last);
+      lv2_atom_forge_object(forge,&obj,0,drmr->uris.patch_set);
+      lv2_atom_forge_key(forge,drmr->uris.patch_property);
+      lv2_atom_forge_urid(forge,drmr->uris.kit_path);
+      lv2_atom_forge_key(forge,drmr->uris.patch_value);
+      lv2_atom_forge_path(forge,drmr->cur_path,path_len);
+      lv2_atom_forge_pop(forge,&obj);
+    }
+    forge_params(drmr,drmr->uris.gain,last);
+    forge_params(drmr,drmr->uris.pan,last);
+    forge_params(drmr,drmr->uris.output,last);
+    drmr->notify_all = 0;
+  }
+  if (drmr->stats.report &&
+      (!notify || forge->size-forge->offset >=
+       (DRMR_TIME_BINS+DRMR_VOICE_BINS)*sizeof(int32_t)+256)) {
+    drmr_stats* st = &drmr->stats;
+    if (notify) {
+      forge_hist(drmr,drmr->uris.block_times,st->time_hist,DRMR_TIME_BINS,last);
+      forge_hist(drmr,drmr->uris.active_voices,st->voice_hist,DRMR_VOICE_BINS,last);
+    }
+    memset(st->time_hist,0,sizeof(st->time_hist));
+    memset(st->voice_hist,0,sizeof(st->voice_hist));
+    st->report = 0;
+  }
+  if (notify) lv2_atom_forge_pop(forge,&drmr->notify_seq);
+}
+
+/* Mix the current kit's voices for the block.  Notes start and stop,
+ * and patch:Sets take effect, at their frame, so the block is cut at
+ * each one, and the spans between them into DRMR_SUB_BLOCK frame
+ * pieces: every voice is mixed into a piece while its outputs are
+ * still in cache, then the next piece.  Helpers mix a whole span
+ * between cuts at a time.  Call with load_mutex held. */
+static void mix_block(DrMr *drmr, uint32_t n_samples) {
+  uint32_t pos = 0,end,p,len;
+  int t,v,first;
+  // a gain set at the same frame as a note picks its layer
+  apply_params(drmr,0,n_samples);
+  t = play_triggers(drmr,0,0);
+  update_coefs(drmr,0,n_samples);
+  if (drmr->par_backoff > 0)
+    drmr->par_backoff--;
+  while (pos < n_samples) {
+    end = t < drmr->num_triggers ? drmr->triggers[t].offset : n_samples;
+    p = next_param_frame(drmr,n_samples);
+    if (p < end) end = p;
+    if (drmr->num_helpers > 0 && drmr->par_backoff == 0 &&
+	drmr->num_voices >= DRMR_PAR_MIN_VOICES && end-pos <= DRMR_HELPER_FRAMES)
+      mix_parallel(drmr,pos,end-pos);
+    else
+      for (;pos < end;pos += len) {
+	len = end-pos < DRMR_SUB_BLOCK ? end-pos : DRMR_SUB_BLOCK;
+	for (v = 0;v < drmr->num_voices;v++) {
+	  int i = drmr->voices[v];
+	  int b = voice_bus(drmr,i);
+	  render_voice(drmr,i,drmr->left[b]+pos,drmr->right[b]+pos,pos,len);
 	}
       }
-      if (cs->offset >= cs->limit) cs->active = 0;
+    pos = end;
+    apply_params(drmr,pos,n_samples);
+    first = t;
+    t = play_triggers(drmr,t,pos);
+    // new and restarted voices get their coefficients now
+    for (;first < t;first++)
+      if (drmr->triggers[first].velocity > 0)
+	update_coef(drmr,drmr->triggers[first].sample,pos,n_samples);
+  }
+  finish_coef_ramps(drmr,n_samples);
+}
+
+static void run_block(LV2_Handle instance, uint32_t n_samples) {
+  int i,v,kitInt,ignno,curve,budget,trim,normalize,lock,threads,ch,chan_changed = 0;
+  DrMr* drmr = (DrMr*)instance;
+
+  kitInt = (int)floorf(*(drmr->kitReq));
+  ignno = (int)floorf(*(drmr->ignore_note_off));
+  curve = drmr->velocity_curve ? (int)floorf(*(drmr->velocity_curve)) : VELOCITY_LINEAR;
+  if (curve < VELOCITY_LINEAR || curve > VELOCITY_USER) curve = VELOCITY_LINEAR;
+  if ((int)floorf(*(drmr->ignore_velocity))) curve = VELOCITY_FIXED;
+  budget = drmr->mem_budget ? (int)floorf(*(drmr->mem_budget)) : 0;
+  if (budget < 0) budget = 0;
+  trim = drmr->trim ? (int)floorf(*(drmr->trim)) : TRIM_DEFAULT;
+  if (trim < TRIM_MIN) trim = TRIM_MIN;
+  if (trim > TRIM_MAX) trim = TRIM_MAX;
+  normalize = drmr->normalize ? (int)floorf(*(drmr->normalize)) : NORMALIZE_OFF;
+  if (normalize < NORMALIZE_OFF || normalize > NORMALIZE_LOUDNESS) normalize = NORMALIZE_OFF;
+  lock = drmr->lock_memory ? (*(drmr->lock_memory) > 0.5f) : 0;
+  threads = drmr->render_threads ? (int)floorf(*(drmr->render_threads)) : 1;
+  if (threads < 1) threads = 1;
+  if (threads > DRMR_MAX_HELPERS+1) threads = DRMR_MAX_HELPERS+1;
+
+  // buses that aren't connected are skipped, samples sent to them
+  // play on the main outputs instead
+  memset(drmr->left[0],0,n_samples*sizeof(float));
+  memset(drmr->right[0],0,n_samples*sizeof(float));
+  for (i = 1;i <= DRMR_NUM_BUSES;i++)
+    if (drmr->left[i] && drmr->right[i]) {
+      memset(drmr->left[i],0,n_samples*sizeof(float));
+      memset(drmr->right[i],0,n_samples*sizeof(float));
+    }
+
+  pthread_mutex_lock(&drmr->load_mutex); 
+  handle_messages(drmr);
+  if (curve != drmr->vel_curve)
+    build_velocity_table(drmr,curve);
+  decode_midi(drmr,n_samples,ignno);
+  if (kitInt != drmr->port_kit) {
+    // after a state restore, the port value the host restored along
+    // with it refers to the restored kit, so don't load it by index
+    int resync = drmr->port_kit == KIT_PORT_RESYNC;
+    drmr->port_kit = kitInt;
+    if (!resync) {
+      drmr->req_kit = kitInt;
+      drmr->req_path[0] = 0;
+      chan_changed = 1;
     }
   }
+  for (ch = 1;ch < DRMR_NUM_CHANNELS;ch++) {
+    int k = drmr->chan_kit[ch] ? (int)floorf(*(drmr->chan_kit[ch])) : -1;
+    if (k < -1) k = -1;
+    if (k != drmr->req_chan_kit[ch]) {
+      drmr->req_chan_kit[ch] = k;
+      chan_changed = 1;
+    }
+  }
+  if (chan_changed)
+    post_load_request(drmr,budget,trim,normalize,lock);
+  if (budget != drmr->req_budget || trim != drmr->req_trim ||
+      normalize != drmr->req_normalize || lock != drmr->req_lock)
+    post_load_request(drmr,budget,trim,normalize,lock);
+  if (threads != drmr->req_threads) {
+    // doesn't cancel a load, the loader starts the helpers after it
+    struct sched_param param;
+    if (pthread_getschedparam(pthread_self(),&drmr->req_policy,&param) == 0)
+      drmr->req_prio = param.sched_priority;
+    drmr->req_threads = threads;
+    drmr->req_seq++;
+    pthread_cond_signal(&drmr->load_cond);
+  }
+  // voices still playing from the last block, run_retired() and new
+  // notes add theirs
+  drmr->block_voices = drmr->num_voices;
+  if (drmr->num_retired_voices > 0)
+    run_retired(drmr,n_samples);
+  if (drmr->num_voices == 0 && drmr->num_triggers == 0)
+    // nothing sounding, silence is all we need to output
+    apply_params(drmr,n_samples,n_samples);
+  else {
+    mix_block(drmr,n_samples);
+    for (v = 0;v < drmr->num_voices;) {
+      i = drmr->voices[v];
+      drmr_sample* cs = drmr->samples+i;
+      if (cs->offset >= cs->limit) {
+	cs->active = 0;
+	remove_voice(drmr,v);
+      }
+      else
+	v++;
+    }
+  }
+  finish_messages(drmr,n_samples);
   pthread_mutex_unlock(&drmr->load_mutex); 
 }
 
+/* Add one block to the histograms, and once per DRMR_STATS_WINDOW
+ * publish load, voices and peak block time on the output ports, and
+ * have the next block send the histograms. */
+static void update_stats(DrMr *drmr, uint64_t ns, uint32_t n_samples) {
+  drmr_stats* st = &drmr->stats;
+  int bin = ns > 0 ? 63-__builtin_clzll(ns) : 0;
+  int vbin = drmr->block_voices < DRMR_VOICE_BINS ? drmr->block_voices : DRMR_VOICE_BINS-1;
+  st->time_hist[bin < DRMR_TIME_BINS ? bin : DRMR_TIME_BINS-1]++;
+  st->voice_hist[vbin]++;
+  st->blocks++;
+
+  st->window_ns += ns;
+  st->window_frames += n_samples;
+  if (ns > st->window_peak_ns) st->window_peak_ns = ns;
+  if (drmr->active_voices)
+    *(drmr->active_voices) = drmr->block_voices;
+  if (drmr->kit_memory) *(drmr->kit_memory) = drmr->kit_bytes/1048576.0f;
+  if (st->window_frames >= drmr->rate*DRMR_STATS_WINDOW) {
+    double window_secs = st->window_frames/drmr->rate;
+    if (drmr->dsp_load)
+      *(drmr->dsp_load) = (float)(st->window_ns/(window_secs*1e9)*100.0);
+    if (drmr->peak_time)
+      *(drmr->peak_time) = st->window_peak_ns/1000.0f;
+    st->window_ns = 0;
+    st->window_peak_ns = 0;
+    st->window_frames = 0;
+    st->report = 1;
+  }
+}
+
+static void run(LV2_Handle instance, uint32_t n_samples) {
+  DrMr* drmr = (DrMr*)instance;
+  uint64_t start = now_ns();
+  run_block(instance,n_samples);
+  update_stats(drmr,now_ns()-start,n_samples);
+}
+
 static void cleanup(LV2_Handle instance) {
+  int i;
   DrMr* drmr = (DrMr*)instance;
   pthread_cancel(drmr->load_thread);
   pthread_join(drmr->load_thread, 0);
-  if (drmr->num_samples > 0)
-    free_samples(drmr->samples,drmr->num_samples);
-  free_kits(drmr->kits);
-  free(drmr->gains);
+  // the cancelled loader may still hold load_mutex, and run() can't be
+  // running now anyway, so no need to lock for the helper buffers
+  for (i = 0;i < drmr->running_helpers;i++) {
+    stop_helper(drmr->helpers+i);
+    free(drmr->helpers[i].buf);
+  }
+  free(drmr->samples);
+  free(drmr->coefs);
+  free(drmr->restore_gains);
+  free(drmr->restore_pans);
+  free(drmr->restore_outputs);
+  for (i = 0;i < DRMR_MAX_RETIRED;i++) {
+    free(drmr->retired[i].samples);
+    free(drmr->retired[i].coefs);
+  }
+  for (i = 0;i < DRMR_MAX_STORED;i++)
+    if (drmr->store[i].path) {
+      if (drmr->store[i].locked)
+	lock_samples(drmr->store[i].samples,drmr->store[i].num_samples,0);
+      free_samples(drmr->store[i].samples,drmr->store[i].num_samples);
+      free(drmr->store[i].path);
+    }
+  if (drmr->kit_watch) free_kit_watch(drmr->kit_watch);
+  if (drmr->kits) free_kits(drmr->kits);
   free(instance);
 }
 
+/* store the gain, pan or output of every sample, or the curve points,
+ * as a vector of floats or ints (type) */
+static LV2_State_Status save_params(DrMr* drmr, LV2_State_Store_Function store,
+				    LV2_State_Handle handle, LV2_URID key,
+				    LV2_URID type, const void* vals, int n) {
+  size_t size = sizeof(LV2_Atom_Vector_Body)+n*sizeof(float);
+  LV2_Atom_Vector_Body* body = malloc(size);
+  LV2_State_Status ret;
+  body->child_size = sizeof(float);
+  body->child_type = type;
+  memcpy(body+1,vals,n*sizeof(float));
+  ret = store(handle,key,body,size,drmr->uris.atom_vector,
+	      LV2_STATE_IS_POD | LV2_STATE_IS_PORTABLE);
+  free(body);
+  return ret;
+}
+
+// a vector stored by save_params, NULL if there isn't a usable one
+static void* retrieve_params(DrMr* drmr, LV2_State_Retrieve_Function retrieve,
+			     LV2_State_Handle handle, LV2_URID key, LV2_URID child_type,
+			     int* n) {
+  size_t size;
+  uint32_t type, vflags;
+  const LV2_Atom_Vector_Body* body = retrieve(handle,key,&size,&type,&vflags);
+  void* vals;
+  if (!body) return NULL;
+  if (type != drmr->uris.atom_vector || size < sizeof(LV2_Atom_Vector_Body) ||
+      body->child_type != child_type || body->child_size != sizeof(float)) {
+    fprintf(stderr,"Unknown type for saved gains, pans, outputs or velocity curve\n");
+    return NULL;
+  }
+  *n = (size-sizeof(LV2_Atom_Vector_Body))/sizeof(float);
+  vals = malloc(*n*sizeof(float)+1);
+  memcpy(vals,body+1,*n*sizeof(float));
+  return vals;
+}
+
+/* State holds the path of the loaded kit and the gain, pan and output
+ * of each sample, and the user velocity curve points if there are any.
+ * Restoring it loads that path directly, without scanning the kit
+ * directories first, so big sessions don't have to wait for every
+ * instance to scan. */
+static LV2_State_Status
+save_state(LV2_Handle                 instance,
+	   LV2_State_Store_Function   store,
+	   LV2_State_Handle           handle,
+	   uint32_t                   flags,
+	   const LV2_Feature* const*  features) {
+  DrMr* drmr = (DrMr*)instance;
+  LV2_State_Map_Path* map_path = NULL;
+  char path[BUFSIZ];
+  char* apath = NULL;
+  float *gains,*pans;
+  int32_t* outputs;
+  float points[2*DRMR_MAX_CURVE_POINTS];
+  int i,n,num_points;
+  LV2_State_Status ret;
+
+  for (;features && *features;features++)
+    if (!strcmp((*features)->URI, LV2_STATE_MAP_PATH_URI))
+      map_path = (LV2_State_Map_Path*)((*features)->data);
+
+  pthread_mutex_lock(&drmr->load_mutex);
+  memcpy(path,drmr->cur_path,BUFSIZ);
+  n = drmr->num_samples;
+  gains = malloc(2*n*sizeof(float)+n*sizeof(int32_t)+1);
+  pans = gains+n;
+  outputs = (int32_t*)(pans+n);
+  for (i = 0;i < n;i++) {
+    gains[i] = drmr->coefs[i].gain;
+    pans[i] = drmr->coefs[i].pan;
+    outputs[i] = drmr->coefs[i].output;
+  }
+  num_points = drmr->num_curve_points;
+  memcpy(points,drmr->curve_points,2*num_points*sizeof(float));
+  pthread_mutex_unlock(&drmr->load_mutex);
+  if (num_points > 0) {
+    ret = save_params(drmr,store,handle,drmr->uris.velocity_curve,drmr->forge.Float,
+		      points,2*num_points);
+    if (ret != LV2_STATE_SUCCESS) {
+      free(gains);
+      return ret;
+    }
+  }
+  if (!path[0]) { // no kit, nothing else to save
+    free(gains);
+    return LV2_STATE_SUCCESS;
+  }
+
+  if (map_path) apath = map_path->abstract_path(map_path->handle,path);
+  ret = store(handle,drmr->uris.kit_path,
+	      apath?apath:path,strlen(apath?apath:path)+1,
+	      drmr->uris.atom_path,
+	      LV2_STATE_IS_POD | LV2_STATE_IS_PORTABLE);
+  if (apath) free(apath);
+  if (ret == LV2_STATE_SUCCESS)
+    ret = save_params(drmr,store,handle,drmr->uris.gain,drmr->forge.Float,gains,n);
+  if (ret == LV2_STATE_SUCCESS)
+    ret = save_params(drmr,store,handle,drmr->uris.pan,drmr->forge.Float,pans,n);
+  if (ret == LV2_STATE_SUCCESS)
+    ret = save_params(drmr,store,handle,drmr->uris.output,drmr->forge.Int,outputs,n);
+  free(gains);
+  return ret;
+}
+
+static LV2_State_Status
+restore_state(LV2_Handle                  instance,
+	      LV2_State_Retrieve_Function retrieve,
+	      LV2_State_Handle            handle,
+	      uint32_t                    flags,
+	      const LV2_Feature* const*   features) {
+  DrMr* drmr = (DrMr*)instance;
+  LV2_State_Map_Path* map_path = NULL;
+  size_t size;
+  uint32_t type, vflags;
+  const char* value;
+  char* path = NULL;
+  float *gains,*pans,*points;
+  int32_t* outputs;
+  int num_gains = 0, num_pans = 0, num_outputs = 0, num_points = 0;
+
+  for (;features && *features;features++)
+    if (!strcmp((*features)->URI, LV2_STATE_MAP_PATH_URI))
+      map_path = (LV2_State_Map_Path*)((*features)->data);
+
+  points = retrieve_params(drmr,retrieve,handle,drmr->uris.velocity_curve,drmr->forge.Float,
+			   &num_points);
+  pthread_mutex_lock(&drmr->load_mutex);
+  if (!points || !set_curve_points(drmr,points,num_points))
+    set_curve_points(drmr,NULL,0);
+  pthread_mutex_unlock(&drmr->load_mutex);
+  free(points);
+
+  value = retrieve(handle,drmr->uris.kit_path,&size,&type,&vflags);
+  if (!value) return LV2_STATE_SUCCESS; // old session, kit_num will do
+  if (type != drmr->uris.atom_path) {
+    fprintf(stderr,"Unknown type for saved kit path\n");
+    return LV2_STATE_ERR_BAD_TYPE;
+  }
+  if (map_path) path = map_path->absolute_path(map_path->handle,value);
+  // sessions saved before gains and pans were in the state have none
+  gains = retrieve_params(drmr,retrieve,handle,drmr->uris.gain,drmr->forge.Float,&num_gains);
+  pans = retrieve_params(drmr,retrieve,handle,drmr->uris.pan,drmr->forge.Float,&num_pans);
+  outputs = retrieve_params(drmr,retrieve,handle,drmr->uris.output,drmr->forge.Int,
+			    &num_outputs);
+  if (!gains || !pans) {
+    free(gains);
+    free(pans);
+    free(outputs);
+    gains = pans = NULL;
+    outputs = NULL;
+    num_outputs = 0;
+  }
+
+  pthread_mutex_lock(&drmr->load_mutex);
+  free(drmr->restore_gains);
+  free(drmr->restore_pans);
+  drmr->restore_gains = gains;
+  drmr->restore_pans = pans;
+  drmr->num_restore = num_gains < num_pans ? num_gains : num_pans;
+  free(drmr->restore_outputs);
+  drmr->restore_outputs = outputs;
+  drmr->num_restore_outputs = outputs ? num_outputs : 0;
+  snprintf(drmr->req_path,BUFSIZ,"%s",path?path:value);
+  drmr->req_kit = -1;
+  drmr->port_kit = KIT_PORT_RESYNC;
+  post_load_request(drmr,drmr->req_budget,drmr->req_trim,drmr->req_normalize,
+		    drmr->req_lock);
+  pthread_mutex_unlock(&drmr->load_mutex);
+  if (path) free(path);
+  return LV2_STATE_SUCCESS;
+}
+
+static const LV2_State_Interface state_iface = { save_state, restore_state };
+
 static const void* extension_data(const char* uri) {
+  if (!strcmp(uri, LV2_STATE_INTERFACE_URI)) return &state_iface;
   return NULL;
 }
 
 static const LV2_Descriptor descriptor = {
-  DRMR_URI,
+  DRMR_PLUGIN_URI,
   instantiate,
   connect_port,
   NULL, // activate
@@ -19,11 +19,15 @@
 
 #include <sndfile.h>
 #include <pthread.h>
+#include <semaphore.h>
 
 #include "lv2/lv2plug.in/ns/lv2core/lv2.h"
-#include "lv2/lv2plug.in/ns/ext/event/event.h"
-#include "lv2/lv2plug.in/ns/ext/event/event-helpers.h"
-#include "lv2/lv2plug.in/ns/ext/uri-map/uri-map.h"
+#include "lv2/lv2plug.in/ns/ext/urid/urid.h"
+#include "lv2/lv2plug.in/ns/ext/state/state.h"
+#include "lv2/lv2plug.in/ns/ext/atom/atom.h"
+#include "lv2/lv2plug.in/ns/ext/atom/forge.h"
+#include "lv2/lv2plug.in/ns/ext/patch/patch.h"
+#include "lv2/lv2plug.in/ns/ext/midi/midi.h"
 
 // drumkit scanned from a hydrogen xml file
 typedef struct {
@@ -32,6 +36,7 @@ typedef struct {
   char* path;
   char** sample_names;
   int samples;
+  char removed;  // kit was deleted since the scan, slot kept so indices stay put
 } scanned_kit;
 
 typedef struct {
@@ -50,8 +55,11 @@ typedef struct {
   float* data;
 } drmr_layer;
 
+struct drmr_kernel;
+
 typedef struct {
   SF_INFO *info;
+  const struct drmr_kernel* kernel;  // renders the layer it's playing
   char active;
   uint32_t offset;
   uint32_t limit;
@@ -61,11 +69,61 @@ typedef struct {
   float* data;
 } drmr_sample;
 
+// gain, pan and output of one sample, and the output coefficients for
+// them.  The coefficients are only recomputed when the gain or pan changes.
+// When they do change while the sample is playing the new value is
+// ramped in from the change's frame to the end of the block.
+typedef struct {
+  float gain;       // dB
+  float pan;        // -1 is left, 1 right
+  int output;       // bus it plays to, 0 for the main pair
+  float coef_gain;  // values the coefficients were computed for
+  float coef_pan;
+  float left;       // coefficients at the start of the block
+  float right;
+  float left_step;  // per-frame change over the current block
+  float right_step;
+} drmr_coef;
+
+/* A note from the midi input, decoded at the start of the block.
+ * Notes are queued in the order they arrive, which is their order in
+ * time. */
+#define DRMR_MAX_TRIGGERS 512  // more notes than this in a block are dropped
+
+typedef struct {
+  uint32_t offset;   // frame in the block
+  uint16_t sample;   // index into samples
+  uint8_t velocity;  // 0 for a note off
+} drmr_trigger;
+
 // lv2 stuff
 
 #define DRMR_URI "http://github.com/nicklan/drmr"
+// The plugin's own URI.  The port layout changed incompatibly (gain and
+// pan moved to patch messages, atom midi input) so it is a new plugin
+// as far as hosts go, the properties keep the DRMR_URI namespace.
+#define DRMR_PLUGIN_URI DRMR_URI "/2"
+// port_kit value that makes run() take the next kit port value as is
+#define KIT_PORT_RESYNC -1000
 #define GAIN_MIN -60.0f
 #define GAIN_MAX 6.0f
+// silence trimming threshold in dB below a layer's peak, TRIM_MIN is off
+#define TRIM_MIN -120
+#define TRIM_MAX -30
+#define TRIM_DEFAULT -80
+// per layer normalization applied at load
+#define NORMALIZE_OFF 0
+#define NORMALIZE_PEAK 1      // peak to 0 dBFS
+#define NORMALIZE_LOUDNESS 2  // loudest 50ms to NORMALIZE_RMS_DB rms
+#define NORMALIZE_RMS_DB -12.0f
+// velocity curves, the level each midi velocity plays at
+#define VELOCITY_LINEAR 0
+#define VELOCITY_LOG 1        // soft hits louder
+#define VELOCITY_EXP 2        // soft hits quieter
+#define VELOCITY_FIXED 3      // everything at full level, as ignore velocity
+#define VELOCITY_USER 4       // straight lines between points sent as drmr:velocityCurve
+#define VELOCITY_CURVE_K 4.0f // how far log and exp bend
+#define DRMR_MAX_CURVE_POINTS 32
 
 typedef enum {
   DRMR_MIDI = 0,
@@ -73,110 +131,317 @@ typedef enum {
   DRMR_RIGHT,
   DRMR_KITNUM,
   DRMR_BASENOTE,
-  DRMR_GAIN_ONE,
-  DRMR_GAIN_TWO,
-  DRMR_GAIN_THREE,
-  DRMR_GAIN_FOUR,
-  DRMR_GAIN_FIVE,
-  DRMR_GAIN_SIX,
-  DRMR_GAIN_SEVEN,
-  DRMR_GAIN_EIGHT,
-  DRMR_GAIN_NINE,
-  DRMR_GAIN_TEN,
-  DRMR_GAIN_ELEVEN,
-  DRMR_GAIN_TWELVE,
-  DRMR_GAIN_THIRTEEN,
-  DRMR_GAIN_FOURTEEN,
-  DRMR_GAIN_FIFTEEN,
-  DRMR_GAIN_SIXTEEN,
-  DRMR_GAIN_SEVENTEEN,
-  DRMR_GAIN_EIGHTEEN,
-  DRMR_GAIN_NINETEEN,
-  DRMR_GAIN_TWENTY,
-  DRMR_GAIN_TWENTYONE,
-  DRMR_GAIN_TWENTYTWO,
-  DRMR_GAIN_TWENTYTHREE,
-  DRMR_GAIN_TWENTYFOUR,
-  DRMR_GAIN_TWENTYFIVE,
-  DRMR_GAIN_TWENTYSIX,
-  DRMR_GAIN_TWENTYSEVEN,
-  DRMR_GAIN_TWENTYEIGHT,
-  DRMR_GAIN_TWENTYNINE,
-  DRMR_GAIN_THIRTY,
-  DRMR_GAIN_THIRTYONE,
-  DRMR_GAIN_THIRTYTWO,
-  DRMR_PAN_ONE,
-  DRMR_PAN_TWO,
-  DRMR_PAN_THREE,
-  DRMR_PAN_FOUR,
-  DRMR_PAN_FIVE,
-  DRMR_PAN_SIX,
-  DRMR_PAN_SEVEN,
-  DRMR_PAN_EIGHT,
-  DRMR_PAN_NINE,
-  DRMR_PAN_TEN,
-  DRMR_PAN_ELEVEN,
-  DRMR_PAN_TWELVE,
-  DRMR_PAN_THIRTEEN,
-  DRMR_PAN_FOURTEEN,
-  DRMR_PAN_FIFTEEN,
-  DRMR_PAN_SIXTEEN,
-  DRMR_PAN_SEVENTEEN,
-  DRMR_PAN_EIGHTEEN,
-  DRMR_PAN_NINETEEN,
-  DRMR_PAN_TWENTY,
-  DRMR_PAN_TWENTYONE,
-  DRMR_PAN_TWENTYTWO,
-  DRMR_PAN_TWENTYTHREE,
-  DRMR_PAN_TWENTYFOUR,
-  DRMR_PAN_TWENTYFIVE,
-  DRMR_PAN_TWENTYSIX,
-  DRMR_PAN_TWENTYSEVEN,
-  DRMR_PAN_TWENTYEIGHT,
-  DRMR_PAN_TWENTYNINE,
-  DRMR_PAN_THIRTY,
-  DRMR_PAN_THIRTYONE,
-  DRMR_PAN_THIRTYTWO,
+  DRMR_CONTROL,
+  DRMR_NOTIFY,
   DRMR_IGNORE_VELOCITY,
   DRMR_IGNORE_NOTE_OFF,
+  DRMR_DSP_LOAD,
+  DRMR_ACTIVE_VOICES,
+  DRMR_PEAK_TIME,
+  DRMR_MEM_BUDGET,
+  DRMR_KIT_MEMORY,
+  DRMR_LOCK_MEMORY,
+  DRMR_KIT_FADE,
+  DRMR_RENDER_THREADS,
+  DRMR_CHAN_KIT_TWO,
+  DRMR_CHAN_KIT_THREE,
+  DRMR_CHAN_KIT_FOUR,
+  DRMR_CHAN_KIT_FIVE,
+  DRMR_CHAN_KIT_SIX,
+  DRMR_CHAN_KIT_SEVEN,
+  DRMR_CHAN_KIT_EIGHT,
+  DRMR_CHAN_KIT_NINE,
+  DRMR_CHAN_KIT_TEN,
+  DRMR_CHAN_KIT_ELEVEN,
+  DRMR_CHAN_KIT_TWELVE,
+  DRMR_CHAN_KIT_THIRTEEN,
+  DRMR_CHAN_KIT_FOURTEEN,
+  DRMR_CHAN_KIT_FIFTEEN,
+  DRMR_CHAN_KIT_SIXTEEN,
+  DRMR_CHAN_BASENOTE_TWO,
+  DRMR_CHAN_BASENOTE_THREE,
+  DRMR_CHAN_BASENOTE_FOUR,
+  DRMR_CHAN_BASENOTE_FIVE,
+  DRMR_CHAN_BASENOTE_SIX,
+  DRMR_CHAN_BASENOTE_SEVEN,
+  DRMR_CHAN_BASENOTE_EIGHT,
+  DRMR_CHAN_BASENOTE_NINE,
+  DRMR_CHAN_BASENOTE_TEN,
+  DRMR_CHAN_BASENOTE_ELEVEN,
+  DRMR_CHAN_BASENOTE_TWELVE,
+  DRMR_CHAN_BASENOTE_THIRTEEN,
+  DRMR_CHAN_BASENOTE_FOURTEEN,
+  DRMR_CHAN_BASENOTE_FIFTEEN,
+  DRMR_CHAN_BASENOTE_SIXTEEN,
+  DRMR_BUS_ONE_LEFT,
+  DRMR_BUS_ONE_RIGHT,
+  DRMR_BUS_TWO_LEFT,
+  DRMR_BUS_TWO_RIGHT,
+  DRMR_BUS_THREE_LEFT,
+  DRMR_BUS_THREE_RIGHT,
+  DRMR_BUS_FOUR_LEFT,
+  DRMR_BUS_FOUR_RIGHT,
+  DRMR_BUS_FIVE_LEFT,
+  DRMR_BUS_FIVE_RIGHT,
+  DRMR_BUS_SIX_LEFT,
+  DRMR_BUS_SIX_RIGHT,
+  DRMR_BUS_SEVEN_LEFT,
+  DRMR_BUS_SEVEN_RIGHT,
+  DRMR_BUS_EIGHT_LEFT,
+  DRMR_BUS_EIGHT_RIGHT,
+  DRMR_TRIM,
+  DRMR_NORMALIZE,
+  DRMR_VELOCITY_CURVE,
   DRMR_NUM_PORTS
 } DrMrPortIndex;
 
+// run() timing, written only by the audio thread.  The histograms
+// count the blocks since they were last sent on the notify port.
+#define DRMR_TIME_BINS 32  // bin i counts blocks taking [2^i,2^(i+1)) ns
+#define DRMR_VOICE_BINS 65 // last bin counts everything above 63 voices
+// how often the output ports are updated, in seconds
+#define DRMR_STATS_WINDOW 0.25
+
+typedef struct {
+  uint32_t time_hist[DRMR_TIME_BINS];
+  uint32_t voice_hist[DRMR_VOICE_BINS];
+  uint64_t blocks;
+  // current reporting window
+  uint64_t window_ns;
+  uint64_t window_peak_ns;
+  uint32_t window_frames;
+  int report;     // a window ended, send the histograms
+} drmr_stats;
+
+#define DRMR_NUM_CHANNELS 16
+// extra stereo outputs samples can be sent to, with drmr:output
+#define DRMR_NUM_BUSES 8
+// most instruments all the channels' kits together can have
+#define DRMR_MAX_VOICES 1024
+
+/* Kits that were swapped out while some of their voices were still
+ * sounding.  They play on from here (optionally fading out) until they
+ * end, then the loader thread releases the kits. */
+#define DRMR_MAX_RETIRED 4
+// the Active Voices port's maximum in the ttl is DRMR_MAX_VOICES*(DRMR_MAX_RETIRED+1)
+
+typedef struct {
+  drmr_sample* samples;   // NULL if this slot is free
+  drmr_coef* coefs;
+  int num_samples;
+  uint16_t voices[DRMR_MAX_VOICES];
+  int num_voices;
+  uint32_t fade_len;      // frames, 0 lets the voices ring out
+  uint32_t fade_left;
+  int kits[DRMR_NUM_CHANNELS]; // store slots behind samples
+  int num_kits;
+} drmr_retired_kit;
+
+/* A kit in the sample store.  Channels playing the same kit share one
+ * copy, which is kept until neither the current kits nor a retired set
+ * use it any more.  Only the loader thread touches these. */
+#define DRMR_MAX_STORED (DRMR_NUM_CHANNELS*(DRMR_MAX_RETIRED+1))
+
+typedef struct {
+  char* path;             // NULL if this slot is free
+  drmr_sample* samples;   // from load_hydrogen_kit(), never played directly
+  int num_samples;
+  int budget;             // MB it was loaded with, what was left for it
+  int trim;               // silence trim threshold it was loaded with
+  int normalize;          // and layer normalization
+  int locked;             // samples are mlocked
+  int refs;
+} drmr_stored_kit;
+
+/* Threads that help run() render the active voices when the render
+ * threads port is above 1.  Each mixes the voices it claims into its
+ * own buffers, one pair per output, which run() adds to the outputs
+ * once all are done.  Helpers never write the voices themselves, they
+ * leave where each one got to in offset[], so run() can stop waiting
+ * for a helper that's late and mix its voices again itself. */
+#define DRMR_MAX_HELPERS 3       // so at most 4 threads render a block
+#define DRMR_HELPER_FRAMES 4096  // longer blocks are rendered by run() alone
+#define DRMR_PAR_MIN_VOICES 8    // fewer voices aren't worth waking helpers for
+#define DRMR_PAR_BACKOFF 256     // blocks to render alone after helpers miss one
+#define DRMR_PAR_WAIT 0.5        // of a job's length, the most run() waits for helpers
+// owners in DrMr.claim, below them is the helper index+1
+#define DRMR_CLAIM_RUN 0
+#define DRMR_CLAIM_REVOKED 0xff
+
+typedef struct {
+  pthread_t thread;
+  sem_t wake;        // posted once per block the helper should join
+  float* buf;        // private mix buffers, NULL if not started
+  float* left[DRMR_NUM_BUSES+1];  // in buf, laid out like DrMr's
+  float* right[DRMR_NUM_BUSES+1];
+  uint32_t gen;      // block the buffers hold a mix for
+  uint32_t touched;  // bit per output written to in block gen
+  uint32_t done;     // last block it finished all its voices of
+  uint32_t offset[DRMR_MAX_VOICES]; // sample offset after mixing, by voice
+  int quit;
+  void* drmr;
+} drmr_helper;
+
+/* run() mixes blocks in pieces of this many frames, so the outputs
+ * stay in L1 cache while every voice is mixed into them.  Set with the
+ * SUB_BLOCK_FRAMES cmake variable. */
+#ifndef DRMR_SUB_BLOCK
+#define DRMR_SUB_BLOCK 128
+#endif
+
 typedef struct {
-  // Ports
-  float* left;
-  float* right;
-  LV2_Event_Buffer *midi_port;
+  // Ports.  [0] is the main pair, then the buses, NULL if not connected
+  float* left[DRMR_NUM_BUSES+1];
+  float* right[DRMR_NUM_BUSES+1];
+  const LV2_Atom_Sequence* midi_port;
+  const LV2_Atom_Sequence* control_port;
+  LV2_Atom_Sequence* notify_port;
 
   // params
-  float** gains;
-  float** pans;
   float* kitReq;
   float* baseNote;
   float* ignore_velocity;
+  float* velocity_curve;
   float* ignore_note_off;
+  float* dsp_load;
+  float* active_voices;
+  float* peak_time;
+  float* mem_budget;
+  float* kit_memory;
+  float* lock_memory;
+  float* kit_fade;
+  float* render_threads;
+  float* trim;
+  float* normalize;
+  float* chan_kit[DRMR_NUM_CHANNELS];   // [0] unused, channel 1 is kitReq
+  float* chan_base[DRMR_NUM_CHANNELS];
   double rate;
 
+  drmr_stats stats;
+
   // URIs
-  LV2_URI_Map_Feature* map;
+  LV2_URID_Map* urid_map;
   struct {
-    uint32_t midi_event;
+    LV2_URID midi_event;
+    LV2_URID kit_path;
+    LV2_URID atom_path;
+    LV2_URID atom_vector;
+    LV2_URID patch_get;
+    LV2_URID patch_set;
+    LV2_URID patch_property;
+    LV2_URID patch_value;
+    LV2_URID instrument;
+    LV2_URID gain;
+    LV2_URID pan;
+    LV2_URID output;
+    LV2_URID velocity_curve;
+    LV2_URID block_times;
+    LV2_URID active_voices;
   } uris;
+  LV2_Atom_Forge forge;
+  LV2_Atom_Forge_Frame notify_seq;  // open on notify_port during run()
+
+  // the next patch:Set on the control port this block, NULL once
+  // they've all been applied, see apply_params()
+  const LV2_Atom_Event* next_param;
 
-  // Available kits
+  // Available kits, scanned by the loader when first needed
   kits* kits;
-  int curKit;
+  struct kit_watch* kit_watch;
+  int curKit;     // index of the current kit, -1 if loaded by path
+  char cur_path[BUFSIZ];
+  size_t kit_bytes;
 
-  // Samples
+  // Samples.  The instruments of every kit that's playing, one kit
+  // after another, channel 1's first.  The structs are copies of the
+  // stored kits' so each set keeps its own playing state.
   drmr_sample* samples;
-  uint8_t num_samples;
+  int num_samples;
+  // gain, pan and output of each of samples, set by patch:Set
+  // messages on the control port.  They stay with the position in
+  // samples when the kits change.
+  drmr_coef* coefs;
+  int notify_all;     // send every gain, pan and output on the notify port
+  // gains, pans and outputs from a restored state, applied once its
+  // kit loads
+  float* restore_gains;
+  float* restore_pans;
+  int num_restore;
+  int32_t* restore_outputs;
+  int num_restore_outputs;
+  // level of each midi velocity under the curve vel_curve.  Rebuilt
+  // by run() when the curve changes, and when the user points do.
+  float vel_table[128];
+  int vel_curve;
+  // velocity,level pairs of VELOCITY_USER, sorted by velocity
+  float curve_points[2*DRMR_MAX_CURVE_POINTS];
+  int num_curve_points;
+  // the part of samples each midi channel plays
+  int chan_first[DRMR_NUM_CHANNELS];
+  int chan_count[DRMR_NUM_CHANNELS];
+  char chan_own[DRMR_NUM_CHANNELS]; // has its own kit and base note
+  drmr_stored_kit store[DRMR_MAX_STORED];
+  int cur_kits[DRMR_NUM_CHANNELS];  // store slots behind samples
+  int num_cur_kits;
+
+  // indexes of samples that are currently playing, so run() only
+  // visits those
+  uint16_t voices[DRMR_MAX_VOICES];
+  int num_voices;
+
+  // this block's notes, see decode_midi()
+  drmr_trigger triggers[DRMR_MAX_TRIGGERS];
+  int num_triggers;
 
-  // loading thread stuff
+  // kits swapped out with voices still playing
+  drmr_retired_kit retired[DRMR_MAX_RETIRED];
+  int num_retired_voices;
+  // voices mixed in the current block, for at least part of it,
+  // retired ones included
+  int block_voices;
+  int retired_done;       // set by run() when a retired kit can be freed
+
+  // parallel rendering, see mix_parallel()
+  drmr_helper helpers[DRMR_MAX_HELPERS];
+  int num_helpers;        // helpers run() may use, changed under load_mutex
+  int running_helpers;    // helper threads started, only the loader touches it
+  uint64_t job;           // block<<32 | voices<<16 | next voice to claim
+  uint32_t job_frames;
+  uint32_t job_pos;       // frame in the block job_frames start at
+  int busy;               // helpers currently claiming or mixing voices
+  uint64_t claim[DRMR_MAX_VOICES]; // block<<8 | owner of each voice
+  int par_backoff;        // blocks left before trying the helpers again
+
+  // loading thread stuff.  run() posts requests, the loader only
+  // looks at the latest one
+  int req_kit;
+  char req_path[BUFSIZ];     // if set, load this instead of req_kit
+  int port_kit;              // kit port value last seen by run()
+  int req_chan_kit[DRMR_NUM_CHANNELS]; // -1 plays channel 1's kit
+  int req_budget;
+  int req_lock;
+  int req_trim;
+  int req_normalize;
+  int req_threads;
+  int req_policy;            // scheduling of the audio thread, for helpers
+  int req_prio;
+  uint32_t req_seq;          // bumped for every request
+  uint32_t req_kit_seq;      // bumped for requests that change the kits
+  volatile int load_cancel;  // set when a request supersedes the current load
   pthread_mutex_t load_mutex;
   pthread_cond_t  load_cond;
   pthread_t load_thread;
 
 } DrMr;
 
+/* Make samples, from load_hydrogen_kit() or pack_samples(), the kit
+ * every channel plays, without going through the loader.  For test
+ * programs, call it before the first run(). */
+void drmr_use_kit(DrMr* drmr, drmr_sample* samples, int num_samples, int locked);
+/* The same for one channel (0 based), which then plays its own kit.
+ * Channel 0 is drmr_use_kit(), the other channels keep their kits. */
+void drmr_use_channel_kit(DrMr* drmr, int channel, drmr_sample* samples, int num_samples,
+			  int locked);
+
 
 #endif // DRMR_H
@@ -0,0 +1,367 @@
+/* drmr_bench.c
+ * LV2 DrMr plugin
+ * Copyright 2012 Nick Lanham <nick@afternight.org>
+ *
+ * Public License v3. source code is available at
+ * <http://github.com/nicklan/drmr>
+
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Headless benchmark for the DrMr run() function.
+ *
+ * Instantiates the plugin straight from its descriptor, installs either
+ * a synthetic kit or a hydrogen kit from disk, and then drives run()
+ * with a generated midi pattern.  Synthetic kits with more instruments
+ * than there are notes above the base note are split over several midi
+ * channels, each with its own kit.  Timing for every block is recorded
+ * and a summary is written as a single JSON object (to stdout, or the
+ * file given with -o) so results can be collected and compared between
+ * builds.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "drmr.h"
+#include "drmr_hydrogen.h"
+#include "drmr_json.h"
+
+#define EVENT_BUF_SIZE 8192
+#define MAX_BLOCK_SIZE 65536
+
+struct bench_opts {
+  uint32_t block_size;
+  double rate;
+  int polyphony;      // notes started on each hit
+  float hit_ms;       // time between hits
+  int blocks;
+  int warmup;
+  int instruments;    // synthetic kit only
+  float sample_secs;  // synthetic kit only
+  int channels;       // synthetic kit only
+  unsigned int seed;
+  char* kit_path;
+  char* out_path;
+  int lock;           // mlock the samples, as the lock_memory port does
+  int threads;        // render_threads port
+};
+
+#define MAX_URIDS 64
+static char* urids[MAX_URIDS];
+static int num_urids = 0;
+
+static LV2_URID bench_map(LV2_URID_Map_Handle handle, const char* uri) {
+  int i;
+  for (i = 0;i < num_urids;i++)
+    if (!strcmp(urids[i],uri)) return i+1;
+  if (num_urids == MAX_URIDS) return 0;
+  urids[num_urids++] = strdup(uri);
+  return num_urids;
+}
+
+// small deterministic generator so runs are repeatable
+static unsigned int rand_state;
+static unsigned int bench_rand() {
+  rand_state = rand_state*1103515245 + 12345;
+  return (rand_state>>16)&0x7fff;
+}
+
+static inline uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return (uint64_t)ts.tv_sec*1000000000ull + ts.tv_nsec;
+}
+
+static int cmp_u64(const void* a, const void* b) {
+  uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+  return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+/* Build a kit of count single layer instruments holding decaying
+ * noise.  Packed the same way load_hydrogen_kit does so the plugin can
+ * free it with free_samples on cleanup. */
+static drmr_sample* make_synth_kit(struct bench_opts* opts, int count) {
+  int i;
+  long j,frames = (long)(opts->sample_secs*opts->rate);
+  drmr_sample* samples = malloc(count*sizeof(drmr_sample));
+  memset(samples,0,count*sizeof(drmr_sample));
+  for (i = 0;i < count;i++) {
+    drmr_sample* s = samples+i;
+    float decay = 5.0f/frames;
+    s->info = malloc(sizeof(SF_INFO));
+    memset(s->info,0,sizeof(SF_INFO));
+    s->info->frames = frames;
+    s->info->channels = opts->channels;
+    s->info->samplerate = (int)opts->rate;
+    s->limit = frames*opts->channels;
+    s->data = malloc(s->limit*sizeof(float));
+    for (j = 0;j < s->limit;j++) {
+      float noise = ((float)bench_rand()/0x3fff)-1.0f;
+      s->data[j] = noise*expf(-decay*(j/opts->channels));
+    }
+  }
+  return pack_samples(samples,count);
+}
+
+/* write this block's note-ons into the midi sequence.  Sample s is
+ * played on channel s/per_chan, where each channel's kit has per_chan
+ * instruments. */
+static void fill_events(LV2_Atom_Forge* forge, LV2_Atom_Sequence* seq, LV2_URID midi_event,
+			struct bench_opts* opts, uint64_t block_start, uint32_t hit_frames,
+			int num_samples, int per_chan, int base_note) {
+  LV2_Atom_Forge_Frame frame;
+  uint64_t next_hit;
+  lv2_atom_forge_set_buffer(forge,(uint8_t*)seq,EVENT_BUF_SIZE);
+  lv2_atom_forge_sequence_head(forge,&frame,0);
+  if (num_samples <= 0) {
+    lv2_atom_forge_pop(forge,&frame);
+    return;
+  }
+  next_hit = ((block_start+hit_frames-1)/hit_frames)*hit_frames;
+  while (next_hit < block_start+opts->block_size) {
+    int k;
+    for (k = 0;k < opts->polyphony;k++) {
+      uint8_t midi[3];
+      int s = bench_rand() % num_samples;
+      midi[0] = 0x90 | (s/per_chan);
+      midi[1] = base_note + s%per_chan;
+      midi[2] = 40 + (bench_rand() % 88);
+      lv2_atom_forge_frame_time(forge,next_hit-block_start);
+      lv2_atom_forge_atom(forge,3,midi_event);
+      lv2_atom_forge_write(forge,midi,3);
+    }
+    next_hit += hit_frames;
+  }
+  lv2_atom_forge_pop(forge,&frame);
+}
+
+static void usage(char* prog) {
+  fprintf(stderr,
+	  "Usage: %s [options]\n"
+	  "  -b frames   block size, 1 to %i (default 256)\n"
+	  "  -r rate     sample rate (default 48000)\n"
+	  "  -p notes    notes started per hit (default 4)\n"
+	  "  -t ms       time between hits (default 125)\n"
+	  "  -n blocks   number of timed blocks (default 10000)\n"
+	  "  -w blocks   warmup blocks, not timed (default 64)\n"
+	  "  -i count    synthetic kit instruments, up to %i (default 16)\n"
+	  "  -l secs     synthetic sample length (default 1.5)\n"
+	  "  -c chans    synthetic sample channels, 1 or 2 (default 2)\n"
+	  "  -s seed     random seed (default 1)\n"
+	  "  -k path     load the hydrogen kit at path instead of a synthetic one\n"
+	  "  -L          lock the samples in memory\n"
+	  "  -T count    render threads, 1 to %i (default 1)\n"
+	  "  -o file     write the JSON result to file instead of stdout\n",
+	  prog,MAX_BLOCK_SIZE,DRMR_MAX_VOICES,DRMR_MAX_HELPERS+1);
+}
+
+int main(int argc, char* argv[]) {
+  struct bench_opts opts;
+  const LV2_Descriptor* desc;
+  LV2_URID_Map map;
+  LV2_Feature map_feature;
+  const LV2_Feature* features[2];
+  LV2_Atom_Forge forge;
+  LV2_Atom_Sequence* midi;
+  LV2_URID midi_event;
+  LV2_Handle handle;
+  DrMr* drmr;
+  drmr_sample* samples;
+  int num_samples,played,per_chan,block_size,ch,i,c;
+  float *left,*right;
+  float kit_num = -1.0f, base_note = 36.0f, ign_vel = 0.0f, ign_off = 1.0f;
+  float lock_mem, threads;
+  uint64_t* times;
+  uint64_t total_ns = 0, frame_pos = 0;
+  double voice_sum = 0.0;
+  int voice_max = 0;
+  uint32_t hit_frames;
+  FILE* out;
+
+  block_size = 256;
+  opts.rate = 48000;
+  opts.polyphony = 4;
+  opts.hit_ms = 125.0f;
+  opts.blocks = 10000;
+  opts.warmup = 64;
+  opts.instruments = 16;
+  opts.sample_secs = 1.5f;
+  opts.channels = 2;
+  opts.seed = 1;
+  opts.kit_path = NULL;
+  opts.out_path = NULL;
+  opts.lock = 0;
+  opts.threads = 1;
+
+  while ((c = getopt(argc,argv,"b:r:p:t:n:w:i:l:c:s:k:LT:o:h")) != -1) {
+    switch (c) {
+    case 'b': block_size = atoi(optarg); break;
+    case 'r': opts.rate = atof(optarg); break;
+    case 'p': opts.polyphony = atoi(optarg); break;
+    case 't': opts.hit_ms = atof(optarg); break;
+    case 'n': opts.blocks = atoi(optarg); break;
+    case 'w': opts.warmup = atoi(optarg); break;
+    case 'i': opts.instruments = atoi(optarg); break;
+    case 'l': opts.sample_secs = atof(optarg); break;
+    case 'c': opts.channels = atoi(optarg); break;
+    case 's': opts.seed = atoi(optarg); break;
+    case 'k': opts.kit_path = optarg; break;
+    case 'L': opts.lock = 1; break;
+    case 'T': opts.threads = atoi(optarg); break;
+    case 'o': opts.out_path = optarg; break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  // notes from the base note up to 127 on each of the channels
+  per_chan = 128-(int)base_note;
+  // checked as ints/floats before anything is converted to a frame count
+  if (block_size < 1 || block_size > MAX_BLOCK_SIZE ||
+      opts.blocks <= 0 || opts.warmup < 0 || opts.rate <= 0 ||
+      opts.polyphony < 1 || !(opts.hit_ms > 0) ||
+      opts.hit_ms*opts.rate/1000.0 > UINT32_MAX ||
+      !(opts.sample_secs > 0) ||
+      opts.instruments <= 0 || opts.instruments > DRMR_MAX_VOICES ||
+      opts.instruments > DRMR_NUM_CHANNELS*per_chan ||
+      opts.channels < 1 || opts.channels > 2 ||
+      opts.threads < 1 || opts.threads > DRMR_MAX_HELPERS+1) {
+    usage(argv[0]);
+    return 1;
+  }
+  opts.block_size = block_size;
+  rand_state = opts.seed;
+  hit_frames = (uint32_t)(opts.hit_ms*opts.rate/1000.0);
+  if (hit_frames == 0) hit_frames = 1;
+
+  map.handle = NULL;
+  map.map = bench_map;
+  map_feature.URI = LV2_URID_MAP_URI;
+  map_feature.data = &map;
+  features[0] = &map_feature;
+  features[1] = NULL;
+  lv2_atom_forge_init(&forge,&map);
+  midi_event = bench_map(NULL,LV2_MIDI__MidiEvent);
+
+  desc = lv2_descriptor(0);
+  handle = desc->instantiate(desc,opts.rate,".",features);
+  if (!handle) {
+    fprintf(stderr,"Could not instantiate plugin\n");
+    return 1;
+  }
+  drmr = (DrMr*)handle;
+
+  if (opts.kit_path) {
+    samples = load_hydrogen_kit(opts.kit_path,opts.rate,0,TRIM_DEFAULT,NORMALIZE_OFF,NULL,
+				&num_samples);
+    if (!samples) {
+      fprintf(stderr,"Could not load kit at %s\n",opts.kit_path);
+      return 1;
+    }
+    if (opts.lock) lock_samples(samples,num_samples,1);
+    drmr_use_kit(drmr,samples,num_samples,opts.lock);
+    played = num_samples;
+    if (played > per_chan) {
+      fprintf(stderr,"Kit has %i instruments, only the first %i have notes\n",
+	      num_samples,per_chan);
+      played = per_chan;
+    }
+  } else {
+    // one kit per channel, as many channels as it takes
+    for (ch = 0,num_samples = 0;num_samples < opts.instruments;ch++) {
+      int count = opts.instruments-num_samples < per_chan ?
+	opts.instruments-num_samples : per_chan;
+      samples = make_synth_kit(&opts,count);
+      if (!samples) return 1;
+      if (opts.lock) lock_samples(samples,count,1);
+      drmr_use_channel_kit(drmr,ch,samples,count,opts.lock);
+      num_samples += count;
+    }
+    played = num_samples;
+  }
+
+  left = malloc(opts.block_size*sizeof(float));
+  right = malloc(opts.block_size*sizeof(float));
+  midi = malloc(EVENT_BUF_SIZE);
+  times = malloc(opts.blocks*sizeof(uint64_t));
+
+  desc->connect_port(handle,DRMR_MIDI,midi);
+  desc->connect_port(handle,DRMR_LEFT,left);
+  desc->connect_port(handle,DRMR_RIGHT,right);
+  desc->connect_port(handle,DRMR_KITNUM,&kit_num);
+  desc->connect_port(handle,DRMR_BASENOTE,&base_note);
+  desc->connect_port(handle,DRMR_IGNORE_VELOCITY,&ign_vel);
+  desc->connect_port(handle,DRMR_IGNORE_NOTE_OFF,&ign_off);
+  // a lock setting different from the kit's would send run() to the
+  // loader for new kits, and it has none to give us
+  lock_mem = opts.lock;
+  threads = opts.threads;
+  desc->connect_port(handle,DRMR_LOCK_MEMORY,&lock_mem);
+  desc->connect_port(handle,DRMR_RENDER_THREADS,&threads);
+  if (desc->activate) desc->activate(handle);
+
+  for (i = 0;i < opts.warmup+opts.blocks;i++) {
+    uint64_t start,end;
+    fill_events(&forge,midi,midi_event,&opts,frame_pos,hit_frames,played,per_chan,
+		(int)base_note);
+    start = now_ns();
+    desc->run(handle,opts.block_size);
+    end = now_ns();
+    frame_pos += opts.block_size;
+    if (i >= opts.warmup) {
+      times[i-opts.warmup] = end-start;
+      total_ns += end-start;
+      voice_sum += drmr->num_voices;
+      if (drmr->num_voices > voice_max) voice_max = drmr->num_voices;
+    }
+  }
+
+  if (desc->deactivate) desc->deactivate(handle);
+  desc->cleanup(handle);
+
+  qsort(times,opts.blocks,sizeof(uint64_t),cmp_u64);
+  out = opts.out_path?fopen(opts.out_path,"w"):stdout;
+  if (!out) {
+    perror("Unable to open output file");
+    return 1;
+  }
+  {
+    double block_budget_ns = opts.block_size*1e9/opts.rate;
+    uint64_t p50 = times[opts.blocks/2];
+    uint64_t p99 = times[(int)((opts.blocks-1)*0.99)];
+    uint64_t max = times[opts.blocks-1];
+    fprintf(out,"{\"kit\": ");
+    json_string(out,opts.kit_path?opts.kit_path:"synthetic");
+    fprintf(out,", \"instruments\": %i, \"rate\": %.0f, \"block_size\": %u, "
+	   "\"polyphony\": %i, \"hit_ms\": %.2f, \"blocks\": %i, \"threads\": %i, "
+	   "\"ns_per_frame\": %.3f, "
+	   "\"block_ns\": {\"mean\": %.1f, \"p50\": %llu, \"p99\": %llu, \"max\": %llu}, "
+	   "\"dsp_load_p99\": %.5f, "
+	   "\"voices\": {\"mean\": %.2f, \"max\": %i}}\n",
+	   num_samples,opts.rate,opts.block_size,
+	   opts.polyphony,opts.hit_ms,opts.blocks,opts.threads,
+	   (double)total_ns/((double)opts.blocks*opts.block_size),
+	   (double)total_ns/opts.blocks,
+	   (unsigned long long)p50,(unsigned long long)p99,(unsigned long long)max,
+	   p99/block_budget_ns,
+	   voice_sum/opts.blocks,voice_max);
+  }
+
+  if (out != stdout) fclose(out);
+  free(times);
+  free(midi);
+  free(left);
+  free(right);
+  return 0;
+}
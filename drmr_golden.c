@@ -0,0 +1,523 @@
+/* drmr_golden.c
+ * LV2 DrMr plugin
+ * Copyright 2012 Nick Lanham <nick@afternight.org>
+ *
+ * Public License v3. source code is available at
+ * <http://github.com/nicklan/drmr>
+
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Golden output regression test for run().
+ *
+ * Renders fixed midi/gain/pan sequences through the plugin against
+ * small kits built in memory, and compares the result with reference
+ * WAVs in the golden directory.  Any sample differing by more than the
+ * tolerance (GOLDEN_TOLERANCE unless -t is given) fails the case.
+ *
+ * Cases with render threads are also rendered by run() alone, and the
+ * two have to agree as well.  Cases that route samples to a bus have
+ * the bus's two channels after the main pair in their reference.
+ *
+ * Run with -w to (re)write the references after an intentional change
+ * to the output.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "drmr.h"
+#include "drmr_hydrogen.h"
+
+#define EVENT_BUF_SIZE 4096
+#define NOTIFY_BUF_SIZE 16384
+#define GOLDEN_RATE 44100
+#define GOLDEN_BLOCK 128
+#define GOLDEN_MAX_BLOCK 1024
+#define GOLDEN_TOLERANCE 1e-5f
+
+enum { GOLDEN_MIDI, GOLDEN_GAIN, GOLDEN_PAN };
+
+// a midi message, or a change of an instrument's gain or pan
+struct golden_event {
+  uint32_t frame;
+  int type;
+  int inst;
+  float value;
+  uint8_t midi[3];
+};
+
+struct golden_case {
+  const char* name;
+  int instruments;
+  int channels;     // 0 alternates mono and stereo instruments
+  int layers;       // 0 for a plain single sample instrument
+  uint32_t frames;
+  float ignore_note_off;
+  float velocity_curve;
+  int threads;      // render threads
+  const struct golden_event* events;
+  int num_events;
+  uint32_t block;   // host block size, 0 for GOLDEN_BLOCK
+  int bus;          // bus the odd instruments play on, 0 for none
+  int chan_kit;     // instruments of midi channel 2's own kit, 0 for none
+};
+
+#define NOTE(f,n,v) { f, GOLDEN_MIDI, 0, 0, { 0x90, 36+(n), v } }
+#define NOTE_OFF(f,n) { f, GOLDEN_MIDI, 0, 0, { 0x80, 36+(n), 0 } }
+#define NOTE_CH2(f,n,v) { f, GOLDEN_MIDI, 0, 0, { 0x91, 36+(n), v } }
+#define GAIN(f,i,v) { f, GOLDEN_GAIN, i, v, { 0, 0, 0 } }
+#define PAN(f,i,v) { f, GOLDEN_PAN, i, v, { 0, 0, 0 } }
+
+static const struct golden_event mono_events[] = {
+  NOTE(0,0,127), NOTE(0,3,64), NOTE(1000,1,100), NOTE(2500,2,30),
+  NOTE(4000,0,90), NOTE(4000,7,127), NOTE(6100,5,1),
+};
+
+static const struct golden_event stereo_events[] = {
+  PAN(0,0,-1.0f), PAN(0,1,1.0f), GAIN(0,2,-12.0f),
+  NOTE(0,0,127), NOTE(0,1,127), NOTE(300,2,127), NOTE(3000,3,80),
+  NOTE(3000,0,60), NOTE(5200,6,110),
+};
+
+static const struct golden_event layer_events[] = {
+  // layer choice follows the gain of the instrument
+  GAIN(0,0,-50.0f), GAIN(0,1,-25.0f), GAIN(0,2,0.0f),
+  NOTE(0,0,127), NOTE(0,1,127), NOTE(0,2,127),
+  GAIN(3000,0,-5.0f),
+  NOTE(3000,0,100), NOTE(4500,3,127),
+};
+
+static const struct golden_event wide_events[] = {
+  NOTE(0,0,127), NOTE(0,31,127), NOTE(0,32,127), NOTE(0,39,127),
+  NOTE(2000,33,50), NOTE(2000,12,50), NOTE(5000,38,90),
+};
+
+static const struct golden_event ramp_events[] = {
+  NOTE(0,0,127), NOTE(0,1,127),
+  GAIN(1024,0,-20.0f), PAN(1024,1,-0.8f),
+  GAIN(2048,0,3.0f), PAN(2304,1,0.9f),
+  NOTE(3000,1,127), GAIN(3500,1,-60.0f),
+};
+
+static const struct golden_event curve_events[] = {
+  // the curve's level picks the layer and scales the output
+  NOTE(0,0,127), NOTE(0,1,100), NOTE(0,2,64),
+  NOTE(2000,3,30), GAIN(4000,0,-20.0f), NOTE(4000,0,110),
+};
+
+static const struct golden_event threads_events[] = {
+  // enough voices at once for the helpers to be woken
+  NOTE(0,0,127), NOTE(0,1,120), NOTE(0,2,110), NOTE(0,3,100), NOTE(0,4,90),
+  NOTE(0,5,80), NOTE(0,6,70), NOTE(0,7,60), NOTE(0,8,127), NOTE(0,9,127),
+  GAIN(1000,2,-12.0f), PAN(1000,3,-0.7f),
+  NOTE(1500,10,127), NOTE(1500,11,100), NOTE(1530,0,90), NOTE(1700,12,127),
+  NOTE(3000,13,127), NOTE(3000,14,127), NOTE(3000,15,127), NOTE_OFF(3300,14),
+};
+
+static const struct golden_event block_events[] = {
+  // blocks of 1000 frames, notes and changes inside the 128 frame
+  // sub-blocks of them and right on their edges
+  NOTE(0,0,127), NOTE(127,1,110), NOTE(128,2,100), NOTE(1130,3,127),
+  GAIN(1190,0,-9.0f), NOTE(1999,4,90), NOTE(2000,5,127), PAN(2300,1,0.6f),
+  NOTE(2303,6,80), NOTE_OFF(2500,2), NOTE(3777,0,127), GAIN(4095,3,2.0f),
+  NOTE(4096,7,127), NOTE(6001,1,64),
+};
+
+static const struct golden_event bus_events[] = {
+  // odd instruments go to the bus, enough voices for the helpers
+  NOTE(0,0,127), NOTE(0,1,127), NOTE(0,2,110), NOTE(0,3,110), NOTE(0,4,100),
+  NOTE(0,5,100), NOTE(0,6,90), NOTE(0,7,90), NOTE(0,8,80),
+  GAIN(700,1,-6.0f), PAN(700,2,0.5f), NOTE(1500,9,127), NOTE(1564,3,127),
+  NOTE(3000,10,127), NOTE(3000,11,127), NOTE_OFF(3400,11),
+};
+
+static const struct golden_event chan_kit_events[] = {
+  // channel 2 plays samples 6 to 10, after channel 1's kit
+  NOTE(0,0,127), NOTE_CH2(0,0,127), NOTE(500,1,100), NOTE_CH2(800,3,100),
+  GAIN(1000,7,-12.0f), NOTE_CH2(1000,1,127), NOTE_CH2(2000,4,60),
+  NOTE_CH2(2500,5,127), NOTE(3000,5,127), PAN(3100,6,-0.9f), NOTE_CH2(4000,0,90),
+};
+
+static const struct golden_event note_off_events[] = {
+  NOTE(0,0,127), NOTE(0,1,127), NOTE_OFF(700,0),
+  NOTE(1500,2,127), NOTE_OFF(2000,2), NOTE(2600,2,127), NOTE_OFF(4000,1),
+};
+
+#define NEV(e) (sizeof(e)/sizeof(e[0]))
+
+static const struct golden_case cases[] = {
+  { "mono",     8, 1, 0, 8192, 1.0f, 0.0f, 1, mono_events,     NEV(mono_events) },
+  { "stereo",   8, 2, 0, 8192, 1.0f, 0.0f, 1, stereo_events,   NEV(stereo_events) },
+  { "layers",   4, 2, 3, 8192, 1.0f, 0.0f, 1, layer_events,    NEV(layer_events) },
+  { "wide",     40, 0, 0, 8192, 1.0f, 0.0f, 1, wide_events,    NEV(wide_events) },
+  { "ramp",     2, 2, 0, 8192, 1.0f, 0.0f, 1, ramp_events,     NEV(ramp_events) },
+  { "note_off", 3, 1, 0, 8192, 0.0f, 0.0f, 1, note_off_events, NEV(note_off_events) },
+  { "curve",    4, 2, 3, 8192, 1.0f, VELOCITY_EXP, 1, curve_events, NEV(curve_events) },
+  { "threads",  16, 0, 0, 8192, 0.0f, 0.0f, 2, threads_events, NEV(threads_events) },
+  { "block",    8, 0, 2, 8192, 0.0f, 0.0f, 1, block_events,   NEV(block_events), 1000 },
+  { "bus",      12, 0, 0, 8192, 0.0f, 0.0f, 2, bus_events,     NEV(bus_events), 0, 3 },
+  { "chan_kit", 6, 2, 0, 8192, 1.0f, 0.0f, 1, chan_kit_events, NEV(chan_kit_events), 0, 0, 5 },
+};
+
+// channels of a case's output, see the top
+static int golden_channels(const struct golden_case* gc) {
+  return gc->bus ? 4 : 2;
+}
+
+#define MAX_URIDS 64
+static char* urids[MAX_URIDS];
+static int num_urids = 0;
+
+static LV2_URID golden_map(LV2_URID_Map_Handle handle, const char* uri) {
+  int i;
+  for (i = 0;i < num_urids;i++)
+    if (!strcmp(urids[i],uri)) return i+1;
+  if (num_urids == MAX_URIDS) return 0;
+  urids[num_urids++] = strdup(uri);
+  return num_urids;
+}
+
+static unsigned int rand_state;
+static unsigned int golden_rand() {
+  rand_state = rand_state*1103515245 + 12345;
+  return (rand_state>>16)&0x7fff;
+}
+
+static void fill_layer(drmr_layer* layer, int channels, long frames, int inst, int layer_num) {
+  long i;
+  int c;
+  float freq = 110.0f*(1+inst%7)*(1+layer_num);
+  layer->info = malloc(sizeof(SF_INFO));
+  memset(layer->info,0,sizeof(SF_INFO));
+  layer->info->frames = frames;
+  layer->info->channels = channels;
+  layer->info->samplerate = GOLDEN_RATE;
+  layer->limit = frames*channels;
+  layer->data = malloc(layer->limit*sizeof(float));
+  for (i = 0;i < frames;i++) {
+    float env = 1.0f-((float)i/frames);
+    for (c = 0;c < channels;c++) {
+      float noise = ((float)golden_rand()/0x3fff)-1.0f;
+      float tone = sinf((2*M_PI*freq*i)/GOLDEN_RATE + c);
+      layer->data[i*channels+c] = 0.5f*env*(0.8f*tone+0.2f*noise);
+    }
+  }
+}
+
+/* build a kit of instruments for a case and pack it like
+ * load_hydrogen_kit does.  seed varies the noise. */
+static drmr_sample* make_kit(const struct golden_case* gc, int instruments, unsigned int seed) {
+  int i,l;
+  drmr_sample* samples = malloc(instruments*sizeof(drmr_sample));
+  memset(samples,0,instruments*sizeof(drmr_sample));
+  rand_state = seed;
+  for (i = 0;i < instruments;i++) {
+    int channels = gc->channels?gc->channels:(1+(i&1));
+    // vary lengths so voices end at different times
+    long frames = 1500+(i*537)%4000;
+    if (gc->layers == 0) {
+      drmr_layer layer;
+      fill_layer(&layer,channels,frames,i,0);
+      samples[i].info = layer.info;
+      samples[i].limit = layer.limit;
+      samples[i].data = layer.data;
+    } else {
+      samples[i].layer_count = gc->layers;
+      samples[i].layers = malloc(gc->layers*sizeof(drmr_layer));
+      for (l = 0;l < gc->layers;l++) {
+	fill_layer(samples[i].layers+l,channels,frames,i,l);
+	samples[i].layers[l].min = (float)l/gc->layers;
+	samples[i].layers[l].max = (float)(l+1)/gc->layers;
+      }
+    }
+  }
+  return pack_samples(samples,instruments);
+}
+
+/* Render a case with threads render threads.  The helpers start in
+ * the background, so wait for them before the first real block. */
+static float* render_case(const struct golden_case* gc, int threads) {
+  const LV2_Descriptor* desc = lv2_descriptor(0);
+  LV2_URID_Map urid_map;
+  LV2_Feature urid_feature;
+  const LV2_Feature* features[2];
+  LV2_Atom_Forge forge,midi_forge;
+  LV2_Atom_Sequence midi[EVENT_BUF_SIZE/sizeof(LV2_Atom_Sequence)];
+  LV2_Atom_Sequence control[EVENT_BUF_SIZE/sizeof(LV2_Atom_Sequence)];
+  LV2_Atom_Sequence notify[NOTIFY_BUF_SIZE/sizeof(LV2_Atom_Sequence)];
+  LV2_URID midi_event,patch_set,patch_property,patch_value,instrument,gain,pan,output;
+  LV2_Handle handle;
+  DrMr* drmr;
+  float left[GOLDEN_MAX_BLOCK],right[GOLDEN_MAX_BLOCK];
+  float bus_left[GOLDEN_MAX_BLOCK],bus_right[GOLDEN_MAX_BLOCK];
+  float ports[DRMR_NUM_PORTS];
+  int channels = golden_channels(gc);
+  uint32_t block = gc->block ? gc->block : GOLDEN_BLOCK;
+  float* out = malloc(gc->frames*channels*sizeof(float));
+  uint32_t pos,i;
+  int e = 0, p;
+
+  urid_map.handle = NULL;
+  urid_map.map = golden_map;
+  urid_feature.URI = LV2_URID_MAP_URI;
+  urid_feature.data = &urid_map;
+  features[0] = &urid_feature;
+  features[1] = NULL;
+  lv2_atom_forge_init(&forge,&urid_map);
+  lv2_atom_forge_init(&midi_forge,&urid_map);
+  midi_event = golden_map(NULL,LV2_MIDI__MidiEvent);
+  patch_set = golden_map(NULL,LV2_PATCH__Set);
+  patch_property = golden_map(NULL,LV2_PATCH__property);
+  patch_value = golden_map(NULL,LV2_PATCH__value);
+  instrument = golden_map(NULL,DRMR_URI "#instrument");
+  gain = golden_map(NULL,DRMR_URI "#gain");
+  pan = golden_map(NULL,DRMR_URI "#pan");
+  output = golden_map(NULL,DRMR_URI "#output");
+
+  handle = desc->instantiate(desc,GOLDEN_RATE,".",features);
+  if (!handle) {
+    free(out);
+    return NULL;
+  }
+  drmr = (DrMr*)handle;
+  drmr_use_kit(drmr,make_kit(gc,gc->instruments,1),gc->instruments,0);
+  if (gc->chan_kit)
+    drmr_use_channel_kit(drmr,1,make_kit(gc,gc->chan_kit,2),gc->chan_kit,0);
+
+  for (p = 0;p < DRMR_NUM_PORTS;p++) ports[p] = 0.0f;
+  ports[DRMR_KITNUM] = -1.0f; // keep the loader away from our kit
+  for (p = DRMR_CHAN_KIT_TWO;p <= DRMR_CHAN_KIT_SIXTEEN;p++)
+    ports[p] = -1.0f;
+  ports[DRMR_BASENOTE] = 36.0f;
+  ports[DRMR_CHAN_BASENOTE_TWO] = 36.0f;
+  ports[DRMR_TRIM] = TRIM_DEFAULT; // as the kit was "loaded" with
+  ports[DRMR_NORMALIZE] = NORMALIZE_OFF;
+  ports[DRMR_IGNORE_NOTE_OFF] = gc->ignore_note_off;
+  ports[DRMR_VELOCITY_CURVE] = gc->velocity_curve;
+  ports[DRMR_RENDER_THREADS] = threads;
+  desc->connect_port(handle,DRMR_MIDI,midi);
+  desc->connect_port(handle,DRMR_LEFT,left);
+  desc->connect_port(handle,DRMR_RIGHT,right);
+  desc->connect_port(handle,DRMR_CONTROL,control);
+  desc->connect_port(handle,DRMR_NOTIFY,notify);
+  if (gc->bus) {
+    desc->connect_port(handle,DRMR_BUS_ONE_LEFT+2*(gc->bus-1),bus_left);
+    desc->connect_port(handle,DRMR_BUS_ONE_RIGHT+2*(gc->bus-1),bus_right);
+  }
+  for (p = DRMR_KITNUM;p < DRMR_NUM_PORTS;p++)
+    if (p != DRMR_CONTROL && p != DRMR_NOTIFY &&
+	(p < DRMR_BUS_ONE_LEFT || p > DRMR_BUS_EIGHT_RIGHT)) // audio, left unconnected
+      desc->connect_port(handle,p,ports+p);
+  if (desc->activate) desc->activate(handle);
+
+  if (threads > 1) {
+    LV2_Atom_Forge_Frame seq;
+    int tries, helpers = 0;
+    lv2_atom_forge_set_buffer(&midi_forge,(uint8_t*)midi,sizeof(midi));
+    lv2_atom_forge_sequence_head(&midi_forge,&seq,0);
+    lv2_atom_forge_pop(&midi_forge,&seq);
+    lv2_atom_forge_set_buffer(&forge,(uint8_t*)control,sizeof(control));
+    lv2_atom_forge_sequence_head(&forge,&seq,0);
+    lv2_atom_forge_pop(&forge,&seq);
+    notify->atom.size = sizeof(notify)-sizeof(LV2_Atom);
+    desc->run(handle,0); // asks the loader for the helpers
+    for (tries = 0;tries < 2000 && helpers < threads-1;tries++) {
+      usleep(1000);
+      pthread_mutex_lock(&drmr->load_mutex);
+      helpers = drmr->num_helpers;
+      pthread_mutex_unlock(&drmr->load_mutex);
+    }
+    if (helpers < threads-1) {
+      fprintf(stderr,"%s: render helpers didn't start\n",gc->name);
+      desc->cleanup(handle);
+      free(out);
+      return NULL;
+    }
+  }
+
+  for (pos = 0;pos < gc->frames;pos += block) {
+    LV2_Atom_Forge_Frame seq,midi_seq;
+    uint32_t n = gc->frames-pos < block ? gc->frames-pos : block;
+    lv2_atom_forge_set_buffer(&midi_forge,(uint8_t*)midi,sizeof(midi));
+    lv2_atom_forge_sequence_head(&midi_forge,&midi_seq,0);
+    lv2_atom_forge_set_buffer(&forge,(uint8_t*)control,sizeof(control));
+    lv2_atom_forge_sequence_head(&forge,&seq,0);
+    notify->atom.size = sizeof(notify)-sizeof(LV2_Atom);
+    if (pos == 0 && gc->bus) {
+      // every output in one go, as a vector
+      LV2_Atom_Forge_Frame obj,vec;
+      lv2_atom_forge_frame_time(&forge,0);
+      lv2_atom_forge_object(&forge,&obj,0,patch_set);
+      lv2_atom_forge_key(&forge,patch_property);
+      lv2_atom_forge_urid(&forge,output);
+      lv2_atom_forge_key(&forge,patch_value);
+      lv2_atom_forge_vector_head(&forge,&vec,sizeof(int32_t),forge.Int);
+      for (p = 0;p < gc->instruments;p++) {
+	int32_t b = (p&1) ? gc->bus : 0;
+	lv2_atom_forge_raw(&forge,&b,sizeof(int32_t));
+      }
+      lv2_atom_forge_pad(&forge,gc->instruments*sizeof(int32_t));
+      lv2_atom_forge_pop(&forge,&vec);
+      lv2_atom_forge_pop(&forge,&obj);
+    }
+    while (e < gc->num_events && gc->events[e].frame < pos+n) {
+      const struct golden_event* ev = gc->events+e;
+      if (ev->type == GOLDEN_MIDI) {
+	lv2_atom_forge_frame_time(&midi_forge,ev->frame-pos);
+	lv2_atom_forge_atom(&midi_forge,3,midi_event);
+	lv2_atom_forge_write(&midi_forge,ev->midi,3);
+      } else {
+	LV2_Atom_Forge_Frame obj;
+	lv2_atom_forge_frame_time(&forge,ev->frame-pos);
+	lv2_atom_forge_object(&forge,&obj,0,patch_set);
+	lv2_atom_forge_key(&forge,patch_property);
+	lv2_atom_forge_urid(&forge,ev->type == GOLDEN_GAIN ? gain : pan);
+	lv2_atom_forge_key(&forge,instrument);
+	lv2_atom_forge_int(&forge,ev->inst);
+	lv2_atom_forge_key(&forge,patch_value);
+	lv2_atom_forge_float(&forge,ev->value);
+	lv2_atom_forge_pop(&forge,&obj);
+      }
+      e++;
+    }
+    lv2_atom_forge_pop(&forge,&seq);
+    lv2_atom_forge_pop(&midi_forge,&midi_seq);
+    desc->run(handle,n);
+    for (i = 0;i < n;i++) {
+      out[(pos+i)*channels] = left[i];
+      out[(pos+i)*channels+1] = right[i];
+      if (gc->bus) {
+	out[(pos+i)*channels+2] = bus_left[i];
+	out[(pos+i)*channels+3] = bus_right[i];
+      }
+    }
+  }
+
+  if (desc->deactivate) desc->deactivate(handle);
+  desc->cleanup(handle);
+  return out;
+}
+
+static int write_reference(const char* path, float* data, uint32_t frames, int channels) {
+  SF_INFO info;
+  SNDFILE* sndf;
+  memset(&info,0,sizeof(SF_INFO));
+  info.samplerate = GOLDEN_RATE;
+  info.channels = channels;
+  info.format = SF_FORMAT_WAV|SF_FORMAT_FLOAT;
+  sndf = sf_open(path,SFM_WRITE,&info);
+  if (!sndf) {
+    fprintf(stderr,"Couldn't write %s: %s\n",path,sf_strerror(NULL));
+    return 1;
+  }
+  sf_writef_float(sndf,data,frames);
+  sf_close(sndf);
+  return 0;
+}
+
+// returns the max abs difference, or -1 if the reference is unusable
+static float compare_reference(const char* path, float* data, uint32_t frames,
+			       int channels) {
+  SF_INFO info;
+  SNDFILE* sndf;
+  float* ref;
+  float diff = 0.0f;
+  uint32_t i;
+  memset(&info,0,sizeof(SF_INFO));
+  sndf = sf_open(path,SFM_READ,&info);
+  if (!sndf) {
+    fprintf(stderr,"Couldn't open %s: %s\n",path,sf_strerror(NULL));
+    return -1.0f;
+  }
+  if (info.channels != channels || info.frames != frames) {
+    fprintf(stderr,"%s has %i channels and %li frames, expected %i and %u\n",
+	    path,info.channels,(long)info.frames,channels,frames);
+    sf_close(sndf);
+    return -1.0f;
+  }
+  ref = malloc(frames*channels*sizeof(float));
+  sf_readf_float(sndf,ref,frames);
+  sf_close(sndf);
+  for (i = 0;i < frames*channels;i++) {
+    float d = fabsf(ref[i]-data[i]);
+    if (d > diff || d != d) diff = d;
+  }
+  free(ref);
+  return diff;
+}
+
+int main(int argc, char* argv[]) {
+  char path[BUFSIZ];
+  char* dir;
+  float tolerance = GOLDEN_TOLERANCE;
+  int write = 0, failed = 0;
+  int c,i;
+
+  while ((c = getopt(argc,argv,"wt:h")) != -1) {
+    switch (c) {
+    case 'w': write = 1; break;
+    case 't': tolerance = atof(optarg); break;
+    default:
+      fprintf(stderr,"Usage: %s [-w] [-t tolerance] golden_dir\n",argv[0]);
+      return 1;
+    }
+  }
+  if (optind != argc-1) {
+    fprintf(stderr,"Usage: %s [-w] [-t tolerance] golden_dir\n",argv[0]);
+    return 1;
+  }
+  dir = argv[optind];
+
+  for (i = 0;i < sizeof(cases)/sizeof(cases[0]);i++) {
+    const struct golden_case* gc = cases+i;
+    float* out = render_case(gc,gc->threads);
+    float par_diff = 0.0f;
+    if (!out) {
+      fprintf(stderr,"FAIL %s: could not instantiate plugin\n",gc->name);
+      failed++;
+      continue;
+    }
+    if (gc->threads > 1) {
+      // helpers only change the order voices are added up in
+      float* alone = render_case(gc,1);
+      uint32_t f;
+      if (!alone) par_diff = -1.0f;
+      for (f = 0;alone && f < gc->frames*golden_channels(gc);f++) {
+	float d = fabsf(alone[f]-out[f]);
+	if (d > par_diff || d != d) par_diff = d;
+      }
+      free(alone);
+    }
+    snprintf(path,BUFSIZ,"%s/%s.wav",dir,gc->name);
+    if (write) {
+      if (write_reference(path,out,gc->frames,golden_channels(gc)))
+	failed++;
+      else
+	fprintf(stderr,"wrote %s\n",path);
+    } else {
+      float diff = compare_reference(path,out,gc->frames,golden_channels(gc));
+      if (par_diff < 0 || par_diff > tolerance || par_diff != par_diff) {
+	fprintf(stderr,"FAIL %s: %i threads differ from 1 by %g (tolerance %g)\n",
+		gc->name,gc->threads,par_diff,tolerance);
+	failed++;
+      } else if (diff < 0 || diff > tolerance || diff != diff) {
+	fprintf(stderr,"FAIL %s: max difference %g (tolerance %g)\n",gc->name,diff,tolerance);
+	failed++;
+      } else
+	fprintf(stderr,"PASS %s: max difference %g\n",gc->name,diff);
+    }
+    free(out);
+  }
+  return failed?1:0;
+}
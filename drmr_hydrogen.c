@@ -23,6 +23,14 @@
 #include <dirent.h>
 #include <errno.h>
 #include <math.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#include <unistd.h>
 
 #include "samplerate.h"
 #include "drmr.h"
@@ -53,15 +61,107 @@ static char* default_drumkit_locations[] = {
 // for info about availble qualities
 #define RATE_CONV_QUALITY SRC_SINC_MEDIUM_QUALITY
 
+// Number of frames decoded (and rate converted) per step when
+// loading a sample.  Bounds the scratch memory used on top of
+// the final sample buffer.
+#define LOAD_CHUNK_FRAMES 4096
+
 #define MAX_CHAR_DATA 512
 
 char *unknownstr = "(Unknown)";
 
+/* Load profiling.
+ *
+ * Kit loads are timed per phase and per layer, and a one line summary
+ * is printed for each kit.  If the DRMR_TRACE environment variable
+ * names a file, every scan, kit load and layer load is also appended
+ * to it as a Chrome trace event (open it in chrome://tracing or
+ * ui.perfetto.dev).  The file is in the JSON array format, whose
+ * closing ] is optional, so several processes and sessions can append
+ * to the same file. */
+
+struct load_stats {
+  double open_ms;
+  double alloc_ms;
+  double decode_ms;
+  double resample_ms;
+  long file_bytes;   // size of the sound files on disk
+  long alloc_bytes;  // sample memory allocated
+  long trim_bytes;   // silence cut off the ends of the samples
+  int layers;
+};
+
+// sample memory held by all kits loaded in this process
+static long total_sample_bytes = 0;
+
+static FILE* trace_file = NULL;
+static char trace_checked = 0;
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static inline double now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec*1e6 + ts.tv_nsec/1e3;
+}
+
+static void trace_string(FILE* f, const char* str) {
+  fputc('"',f);
+  for (;*str;str++) {
+    if (*str == '"' || *str == '\\') fputc('\\',f);
+    if ((unsigned char)*str >= 0x20) fputc(*str,f);
+  }
+  fputc('"',f);
+}
+
+// returns non-zero if trace events should be written
+static int trace_enabled() {
+  pthread_mutex_lock(&trace_mutex);
+  if (!trace_checked) {
+    char* path = getenv("DRMR_TRACE");
+    if (path && *path) {
+      trace_file = fopen(path,"a");
+      if (!trace_file)
+	fprintf(stderr,"Couldn't open trace file %s: %s\n",path,strerror(errno));
+      else if (ftell(trace_file) == 0)
+	fputs("[\n",trace_file);
+    }
+    trace_checked = 1;
+  }
+  pthread_mutex_unlock(&trace_mutex);
+  return trace_file != NULL;
+}
+
+/* Append a complete ("X") event.  path is added to the args if not
+ * NULL, and extra is a list of already formatted json members for the
+ * args object (or NULL). */
+static void trace_event(const char* cat, const char* name, double start_us,
+			double end_us, const char* path, const char* extra) {
+  if (!trace_enabled()) return;
+  pthread_mutex_lock(&trace_mutex);
+  fprintf(trace_file,"{\"cat\": \"%s\", \"name\": \"%s\", \"ph\": \"X\", "
+	  "\"ts\": %.1f, \"dur\": %.1f, \"pid\": %i, \"tid\": %lu, \"args\": {",
+	  cat,name,start_us,end_us-start_us,(int)getpid(),
+	  (unsigned long)pthread_self()%100000);
+  if (path) {
+    fputs("\"path\": ",trace_file);
+    trace_string(trace_file,path);
+    if (extra) fputs(", ",trace_file);
+  }
+  if (extra) fputs(extra,trace_file);
+  fputs("}},\n",trace_file);
+  fflush(trace_file);
+  pthread_mutex_unlock(&trace_mutex);
+}
+
 struct instrument_layer {
   char* filename;
   float min;
   float max;
   float gain;
+  // filled in when planning the load against a memory budget
+  long est_frames;
+  int channels;
+  char skip;
   struct instrument_layer *next;
 };
 
@@ -70,6 +170,8 @@ struct instrument_info {
   char* filename;
   char* name;
   float gain;
+  long est_frames; // for a top level filename
+  int channels;
   struct instrument_layer *layers;
   struct instrument_info *next;
   // maybe pan/vol/etc..
@@ -108,6 +210,7 @@ startElement(void *userData, const char *name, const char **atts)
 	info->in_layer = 1;
 	info->cur_layer = malloc(sizeof(struct instrument_layer));
 	memset(info->cur_layer,0,sizeof(struct instrument_layer));
+	info->cur_layer->gain = 1.0f;
       }
     }
     if (info->in_instrument_list) {
@@ -115,6 +218,7 @@ startElement(void *userData, const char *name, const char **atts)
 	info->in_instrument = 1;
 	info->cur_instrument = malloc(sizeof(struct instrument_info));
 	memset(info->cur_instrument,0,sizeof(struct instrument_info));
+	info->cur_instrument->gain = 1.0f;
       }
     } else {
       if (!strcmp(name,"instrumentList"))
@@ -156,6 +260,10 @@ endElement(void *userData, const char *name)
       info->cur_instrument->filename = strdup(info->cur_buf);
     if (!strcmp(name,"name"))
       info->cur_instrument->name = strdup(info->cur_buf);
+    // newer kits also have a gain per instrument component, which
+    // hydrogen applies on top of the instrument's
+    if (!info->scan_only && !strcmp(name,"gain"))
+      info->cur_instrument->gain *= atof(info->cur_buf);
   }
 
   info->cur_off = 0;
@@ -229,85 +337,107 @@ static char* expand_path(char* path, char* buf) {
 }
 
 kits* scan_kits() {
-  DIR* dp;
+  return scan_kit_dirs(default_drumkit_locations);
+}
+
+/* Parse dir/name/drumkit.xml far enough to describe the kit.
+ * Returns NULL if there's no readable kit there. */
+static scanned_kit* scan_kit(char* dir, char* name) {
+  double kit_start = now_us();
   FILE* file;
   XML_Parser parser;
-  int done;
+  int done, i = 0;
   struct hp_info info;
   struct kit_info kit_info;
+  struct instrument_info *cur_i;
+  scanned_kit* kit;
+  char buf[BUFSIZ];
+
+  if (snprintf(buf,BUFSIZ,"%s/%s/drumkit.xml",dir,name) >= BUFSIZ) {
+    fprintf(stderr,"Warning: Skipping scan of %s as path name is too long\n",dir);
+    return NULL;
+  }
+  file = fopen(buf,"r");
+  if (!file) return NULL; // couldn't open file
+  parser = XML_ParserCreate(NULL);
+  memset(&info,0,sizeof(struct hp_info));
+  memset(&kit_info,0,sizeof(struct kit_info));
+  info.kit_info = &kit_info;
+  info.scan_only = 1;
+  XML_SetUserData(parser, &info);
+  XML_SetElementHandler(parser, startElement, endElement);  
+  XML_SetCharacterDataHandler(parser, charData);
+  do {
+    int len = (int)fread(buf, 1, sizeof(buf), file);
+    done = len < sizeof(buf);
+    if (XML_Parse(parser, buf, len, done) == XML_STATUS_ERROR) {
+      fprintf(stderr,
+	      "%s at line %lu\n",
+	      XML_ErrorString(XML_GetErrorCode(parser)),
+	      XML_GetCurrentLineNumber(parser));
+      break;
+    }
+  } while (!done);
+  XML_ParserFree(parser);
+  fclose(file);
+  trace_event("scan","scan_kit",kit_start,now_us(),name,NULL);
+  if (!info.kit_info->name) return NULL;
+
+  kit = malloc(sizeof(scanned_kit));
+  memset(kit,0,sizeof(scanned_kit));
+  kit->name = info.kit_info->name;
+  kit->desc = info.kit_info->desc;
+	  
+  cur_i = info.kit_info->instruments;
+  while (cur_i) {
+    kit->samples++;
+    cur_i = cur_i->next;
+  }
+  kit->sample_names = malloc(kit->samples*sizeof(char*));
+  cur_i = info.kit_info->instruments;
+  while (cur_i) {
+    struct instrument_info *to_free = cur_i;
+    if (cur_i->name)
+      kit->sample_names[i++] = cur_i->name;
+    else
+      kit->sample_names[i++] = unknownstr;
+    cur_i = cur_i->next;
+    free(to_free);
+  }
+
+  snprintf(buf,BUFSIZ,"%s/%s/",dir,name);
+  kit->path = strdup(buf);
+  return kit;
+}
+
+// scan each directory in the NULL terminated locations array
+kits* scan_kit_dirs(char** locations) {
+  double scan_start = now_us();
+  DIR* dp;
   struct dirent *ep;
   int cp = 0;
-  char* cur_path = default_drumkit_locations[cp++];
+  char* cur_path = locations[cp++];
   kits* ret = malloc(sizeof(kits));
   struct kit_list* scanned_kits = NULL;
-  char buf[BUFSIZ], path_buf[BUFSIZ];
+  char path_buf[BUFSIZ];
 
   ret->num_kits = 0;
 
   while (cur_path) {
     cur_path = expand_path(cur_path,path_buf);
     if (!cur_path) {
-      cur_path = default_drumkit_locations[cp++];
+      cur_path = locations[cp++];
       continue;
     }
     dp = opendir (cur_path);
     if (dp != NULL) {
       while ((ep = readdir (dp))) {
+	scanned_kit* kit;
 	if (ep->d_name[0]=='.') continue;
-	if (snprintf(buf,BUFSIZ,"%s/%s/drumkit.xml",cur_path,ep->d_name) >= BUFSIZ) {
-	  fprintf(stderr,"Warning: Skipping scan of %s as path name is too long\n",cur_path);
-	  continue;
-	}
-	file = fopen(buf,"r");
-	if (!file) continue; // couldn't open file
-	parser = XML_ParserCreate(NULL);
-	memset(&info,0,sizeof(struct hp_info));
-	memset(&kit_info,0,sizeof(struct kit_info));
-	info.kit_info = &kit_info;
-	info.scan_only = 1;
-	XML_SetUserData(parser, &info);
-	XML_SetElementHandler(parser, startElement, endElement);  
-	XML_SetCharacterDataHandler(parser, charData);
-	do {
-	  int len = (int)fread(buf, 1, sizeof(buf), file);
-	  done = len < sizeof(buf);
-	  if (XML_Parse(parser, buf, len, done) == XML_STATUS_ERROR) {
-	    fprintf(stderr,
-		    "%s at line %lu\n",
-		    XML_ErrorString(XML_GetErrorCode(parser)),
-		    XML_GetCurrentLineNumber(parser));
-	    break;
-	  }
-	} while (!done);
-	XML_ParserFree(parser);
-	if (info.kit_info->name) {
-	  int i = 0;
-	  scanned_kit* kit = malloc(sizeof(scanned_kit));
+	kit = scan_kit(cur_path,ep->d_name);
+	if (kit) {
 	  struct kit_list* node = malloc(sizeof(struct kit_list));
-	  memset(kit,0,sizeof(scanned_kit));
 	  memset(node,0,sizeof(struct kit_list));
-	  kit->name = info.kit_info->name;
-	  kit->desc = info.kit_info->desc;
-	  
-	  struct instrument_info *cur_i = info.kit_info->instruments;
-	  while (cur_i) {
-	    kit->samples++;
-	    cur_i = cur_i->next;
-	  }
-	  kit->sample_names = malloc(kit->samples*sizeof(char*));
-	  cur_i = info.kit_info->instruments;
-	  while (cur_i) {
-	    struct instrument_info *to_free = cur_i;
-	    if (cur_i->name)
-	      kit->sample_names[i++] = cur_i->name;
-	    else
-	      kit->sample_names[i++] = unknownstr;
-	    cur_i = cur_i->next;
-	    free(to_free);
-	  }
-
-	  snprintf(buf,BUFSIZ,"%s/%s/",cur_path,ep->d_name);
-	  kit->path = strdup(buf);
 	  node->skit = kit;
 	  struct kit_list * cur_k = scanned_kits;
 	  if (cur_k) {
@@ -321,7 +451,7 @@ kits* scan_kits() {
     }
     else if (errno != ENOENT)
       fprintf(stderr,"Couldn't open %s: %s\n",cur_path,strerror(errno));
-    cur_path = default_drumkit_locations[cp++];
+    cur_path = locations[cp++];
   }
 
   // valid kits are in scanned_kits at this point
@@ -334,17 +464,18 @@ kits* scan_kits() {
   }
 
   printf("found %i kits\n",cp);
+  {
+    char extra[64];
+    snprintf(extra,64,"\"kits\": %i",cp);
+    trace_event("scan","scan_kits",scan_start,now_us(),NULL,extra);
+  }
   ret->num_kits = cp;
   ret->kits = malloc(cp*sizeof(scanned_kit));
 
   cur_k = scanned_kits;
   cp = 0;
   while(cur_k) {
-    ret->kits[cp].name = cur_k->skit->name;
-    ret->kits[cp].desc = cur_k->skit->desc;
-    ret->kits[cp].path = cur_k->skit->path;
-    ret->kits[cp].samples = cur_k->skit->samples;
-    ret->kits[cp].sample_names = cur_k->skit->sample_names;
+    ret->kits[cp] = *cur_k->skit;
     cp++;
     free(cur_k->skit);
     cur_k = cur_k->next;
@@ -356,7 +487,260 @@ kits* scan_kits() {
   return ret;
 }
 
-void free_samples(drmr_sample* samples, int num_samples) {
+static void free_scanned_kit(scanned_kit* kit) {
+  int i;
+  free(kit->name);
+  free(kit->desc);
+  free(kit->path);
+  for (i = 0;i < kit->samples;i++)
+    if (kit->sample_names[i] != unknownstr) free(kit->sample_names[i]);
+  free(kit->sample_names);
+}
+
+#ifdef __linux__
+/* Watching for kit changes.  Each location gets an inotify watch for
+ * kit directories coming and going, and each kit directory one for its
+ * drumkit.xml being written, moved or deleted.  Changes are applied to
+ * the kits list one kit at a time: an edited kit is re-parsed in place,
+ * a new one is appended and a removed one stays in its slot marked as
+ * removed, so existing indices never move. */
+
+#define KIT_WATCH_LOC_EVENTS (IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO|IN_ONLYDIR)
+#define KIT_WATCH_KIT_EVENTS (IN_CLOSE_WRITE|IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO|IN_ONLYDIR)
+
+struct watched_dir {
+  int wd;
+  int loc;      // index of the location this is, or is in
+  char* name;   // kit directory name, NULL for the location itself
+};
+
+struct kit_watch {
+  int fd;
+  int num_locs;
+  char** locs;  // expanded location paths
+  int num_dirs,max_dirs;
+  struct watched_dir* dirs;
+};
+
+static void add_watch(kit_watch* w, int loc, char* name) {
+  char buf[BUFSIZ];
+  int wd;
+  if (name)
+    snprintf(buf,BUFSIZ,"%s/%s",w->locs[loc],name);
+  else
+    snprintf(buf,BUFSIZ,"%s",w->locs[loc]);
+  wd = inotify_add_watch(w->fd,buf,name?KIT_WATCH_KIT_EVENTS:KIT_WATCH_LOC_EVENTS);
+  if (wd < 0) {
+    if (errno != ENOENT && errno != ENOTDIR)
+      fprintf(stderr,"Couldn't watch %s for kit changes: %s\n",buf,strerror(errno));
+    return;
+  }
+  if (w->num_dirs == w->max_dirs) {
+    w->max_dirs = w->max_dirs?w->max_dirs*2:16;
+    w->dirs = realloc(w->dirs,w->max_dirs*sizeof(struct watched_dir));
+  }
+  w->dirs[w->num_dirs].wd = wd;
+  w->dirs[w->num_dirs].loc = loc;
+  w->dirs[w->num_dirs].name = name?strdup(name):NULL;
+  w->num_dirs++;
+}
+
+static struct watched_dir* find_watch(kit_watch* w, int wd) {
+  int i;
+  for (i = 0;i < w->num_dirs;i++)
+    if (w->dirs[i].wd == wd) return w->dirs+i;
+  return NULL;
+}
+
+kit_watch* watch_kits() {
+  char path_buf[BUFSIZ];
+  char** loc;
+  int l;
+  DIR* dp;
+  struct dirent *ep;
+  kit_watch* w = malloc(sizeof(kit_watch));
+  memset(w,0,sizeof(kit_watch));
+  w->fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+  if (w->fd < 0) {
+    fprintf(stderr,"Couldn't watch for kit changes: %s\n",strerror(errno));
+    free(w);
+    return NULL;
+  }
+  for (loc = default_drumkit_locations;*loc;loc++) {
+    char* path = expand_path(*loc,path_buf);
+    if (!path) continue;
+    w->locs = realloc(w->locs,(w->num_locs+1)*sizeof(char*));
+    w->locs[w->num_locs++] = strdup(path);
+  }
+  for (l = 0;l < w->num_locs;l++) {
+    add_watch(w,l,NULL);
+    if ((dp = opendir(w->locs[l]))) {
+      while ((ep = readdir(dp)))
+	if (ep->d_name[0] != '.') add_watch(w,l,ep->d_name);
+      closedir(dp);
+    }
+  }
+  return w;
+}
+
+int kit_watch_fd(kit_watch* w) {
+  return w->fd;
+}
+
+// re-scan one kit directory and update its entry
+static int refresh_kit(kits* kits, char* dir, char* name) {
+  char buf[BUFSIZ];
+  int i,j;
+  scanned_kit* kit = scan_kit(dir,name);
+  snprintf(buf,BUFSIZ,"%s/%s/",dir,name);
+  for (i = 0;i < kits->num_kits;i++)
+    if (!strcmp(kits->kits[i].path,buf)) break;
+  if (i == kits->num_kits) {
+    if (!kit) return 0;
+    kits->kits = realloc(kits->kits,(kits->num_kits+1)*sizeof(scanned_kit));
+    kits->kits[kits->num_kits++] = *kit;
+    printf("found new kit: %s\n",kit->name);
+    free(kit);
+    return 1;
+  }
+  if (!kit) {
+    if (kits->kits[i].removed) return 0;
+    printf("kit removed: %s\n",kits->kits[i].name);
+    // keep the name and path, so the slot still means something
+    for (j = 0;j < kits->kits[i].samples;j++)
+      if (kits->kits[i].sample_names[j] != unknownstr) free(kits->kits[i].sample_names[j]);
+    kits->kits[i].samples = 0;
+    kits->kits[i].removed = 1;
+    return 1;
+  }
+  printf("kit changed: %s\n",kit->name);
+  free_scanned_kit(kits->kits+i);
+  kits->kits[i] = *kit;
+  free(kit);
+  return 1;
+}
+
+int update_kits(kit_watch* w, kits* kits) {
+  char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  struct { int loc; char* name; } dirty[64];
+  int num_dirty = 0, overflow = 0, changed = 0, i, l;
+  ssize_t len;
+
+  while ((len = read(w->fd,buf,sizeof(buf))) > 0) {
+    char* p;
+    for (p = buf;p < buf+len;) {
+      struct inotify_event* ev = (struct inotify_event*)p;
+      struct watched_dir* wdir = find_watch(w,ev->wd);
+      char* name = NULL;
+      p += sizeof(struct inotify_event)+ev->len;
+      if (ev->mask & IN_Q_OVERFLOW) overflow = 1;
+      if (!wdir) continue;
+      if (ev->mask & IN_IGNORED) { // dir went away
+	free(wdir->name);
+	*wdir = w->dirs[--w->num_dirs];
+	continue;
+      }
+      if (!wdir->name) { // something happened to a kit directory
+	if (!ev->len) continue;
+	name = ev->name;
+	if (ev->mask & (IN_CREATE|IN_MOVED_TO)) add_watch(w,wdir->loc,name);
+      } else if (ev->len && !strcmp(ev->name,"drumkit.xml"))
+	name = wdir->name;
+      if (!name) continue;
+      for (i = 0;i < num_dirty;i++)
+	if (dirty[i].loc == wdir->loc && !strcmp(dirty[i].name,name)) break;
+      if (i < num_dirty) continue;
+      if (num_dirty == 64) {
+	overflow = 1;
+	continue;
+      }
+      dirty[num_dirty].loc = wdir->loc;
+      dirty[num_dirty++].name = strdup(name);
+    }
+  }
+
+  for (i = 0;i < num_dirty;i++) {
+    changed += refresh_kit(kits,w->locs[dirty[i].loc],dirty[i].name);
+    free(dirty[i].name);
+  }
+
+  if (overflow) {
+    // lost track, check every kit we know of and every directory
+    DIR* dp;
+    struct dirent *ep;
+    for (l = 0;l < w->num_locs;l++) {
+      if (!(dp = opendir(w->locs[l]))) continue;
+      while ((ep = readdir(dp)))
+	if (ep->d_name[0] != '.') changed += refresh_kit(kits,w->locs[l],ep->d_name);
+      closedir(dp);
+    }
+    for (i = 0;i < kits->num_kits;i++) {
+      struct stat st;
+      snprintf(buf,sizeof(buf),"%sdrumkit.xml",kits->kits[i].path);
+      if (!kits->kits[i].removed && stat(buf,&st)) {
+	kits->kits[i].removed = 1;
+	changed++;
+      }
+    }
+  }
+  return changed;
+}
+
+void free_kit_watch(kit_watch* w) {
+  int i;
+  close(w->fd);
+  for (i = 0;i < w->num_dirs;i++) free(w->dirs[i].name);
+  for (i = 0;i < w->num_locs;i++) free(w->locs[i]);
+  free(w->dirs);
+  free(w->locs);
+  free(w);
+}
+
+#else // no inotify, the list is only ever what was first scanned
+
+kit_watch* watch_kits() { return NULL; }
+int kit_watch_fd(kit_watch* w) { return -1; }
+int update_kits(kit_watch* w, kits* kits) { return 0; }
+void free_kit_watch(kit_watch* w) { }
+
+#endif
+
+/* Every loaded kit lives in one arena:
+ *
+ *   kit_arena        this header, one cache line
+ *   drmr_sample[]    per instrument state, looked at on every trigger
+ *   drmr_layer[]     all instruments' layers, back to back
+ *   SF_INFO[]        one per loaded file
+ *   pcm              one cache line aligned block per file
+ *
+ * so the metadata touched in run() sits in a few contiguous cache
+ * lines, the whole kit can be locked or freed in one go, and the
+ * pointers in the samples never leave the arena.  The arena itself is
+ * page aligned. */
+#define ARENA_ALIGN 64
+#define ARENA_HEADER ARENA_ALIGN
+#define ARENA_ROUND(x) (((x)+ARENA_ALIGN-1) & ~(size_t)(ARENA_ALIGN-1))
+
+typedef struct {
+  size_t size;
+} kit_arena;
+
+static inline kit_arena* get_arena(drmr_sample* samples) {
+  return (kit_arena*)((char*)samples - ARENA_HEADER);
+}
+
+size_t kit_memory(drmr_sample* samples, int num_samples) {
+  if (!samples) return 0;
+  return get_arena(samples)->size;
+}
+
+size_t total_sample_memory() {
+  long bytes = __sync_add_and_fetch(&total_sample_bytes,0);
+  return bytes > 0 ? bytes : 0;
+}
+
+// free a kit that was built out of separate mallocs
+static void free_loose_samples(drmr_sample* samples, int num_samples) {
   int i,j;
   for (i=0;i<num_samples;i++) {
     if (samples[i].layer_count == 0) {
@@ -373,26 +757,329 @@ void free_samples(drmr_sample* samples, int num_samples) {
   free(samples);
 }
 
+// copy one file's info and pcm into the arena, advancing the cursors
+static void pack_buffer(SF_INFO* info, float* data, uint32_t limit,
+			SF_INFO** info_out, float** data_out,
+			SF_INFO** next_info, char** next_pcm) {
+  *info_out = NULL;
+  *data_out = NULL;
+  if (!info) return;
+  *info_out = (*next_info)++;
+  **info_out = *info;
+  if (data && limit) {
+    *data_out = (float*)*next_pcm;
+    memcpy(*data_out,data,limit*sizeof(float));
+    *next_pcm += ARENA_ROUND(limit*sizeof(float));
+  }
+}
+
+drmr_sample* pack_samples(drmr_sample* loose, int num_samples) {
+  size_t header_bytes, pcm_bytes = 0, size;
+  int i,j,num_layers = 0,num_infos = 0;
+  char *mem,*next_pcm;
+  drmr_sample* samples;
+  drmr_layer* next_layer;
+  SF_INFO* next_info;
+
+  for (i = 0;i < num_samples;i++) {
+    if (loose[i].layer_count == 0) {
+      if (loose[i].info) num_infos++;
+      if (loose[i].data) pcm_bytes += ARENA_ROUND(loose[i].limit*sizeof(float));
+    } else {
+      num_layers += loose[i].layer_count;
+      for (j = 0;j < loose[i].layer_count;j++) {
+	if (loose[i].layers[j].info) num_infos++;
+	if (loose[i].layers[j].data)
+	  pcm_bytes += ARENA_ROUND(loose[i].layers[j].limit*sizeof(float));
+      }
+    }
+  }
+  header_bytes = ARENA_ROUND(ARENA_HEADER + num_samples*sizeof(drmr_sample) +
+			     num_layers*sizeof(drmr_layer) + num_infos*sizeof(SF_INFO));
+  size = header_bytes+pcm_bytes;
+  if (posix_memalign((void**)&mem,sysconf(_SC_PAGESIZE),size)) {
+    fprintf(stderr,"Failed to allocate %.1f MB for kit\n",size/1048576.0);
+    free_loose_samples(loose,num_samples);
+    return NULL;
+  }
+  memset(mem,0,header_bytes);
+  ((kit_arena*)mem)->size = size;
+  samples = (drmr_sample*)(mem+ARENA_HEADER);
+  next_layer = (drmr_layer*)(samples+num_samples);
+  next_info = (SF_INFO*)(next_layer+num_layers);
+  next_pcm = mem+header_bytes;
+
+  // copy and free each piece as we go, so big kits don't need twice
+  // their size in memory at any point
+  for (i = 0;i < num_samples;i++) {
+    drmr_sample* s = samples+i;
+    s->active = 0;
+    s->offset = 0;
+    s->velocity = 0;
+    s->layer_count = loose[i].layer_count;
+    if (loose[i].layer_count == 0) {
+      pack_buffer(loose[i].info,loose[i].data,loose[i].limit,
+		  &s->info,&s->data,&next_info,&next_pcm);
+      s->limit = s->data?loose[i].limit:0;
+      s->layers = NULL;
+      free(loose[i].info);
+      free(loose[i].data);
+    } else {
+      s->layers = next_layer;
+      next_layer += s->layer_count;
+      for (j = 0;j < s->layer_count;j++) {
+	drmr_layer* l = s->layers+j;
+	drmr_layer* ll = loose[i].layers+j;
+	l->min = ll->min;
+	l->max = ll->max;
+	pack_buffer(ll->info,ll->data,ll->limit,&l->info,&l->data,&next_info,&next_pcm);
+	l->limit = l->data?ll->limit:0;
+	free(ll->info);
+	free(ll->data);
+      }
+      free(loose[i].layers);
+      // trigger() picks the real layer
+      s->info = s->layers[0].info;
+      s->data = s->layers[0].data;
+      s->limit = s->layers[0].limit;
+    }
+  }
+  free(loose);
+  __sync_add_and_fetch(&total_sample_bytes,(long)size);
+  return samples;
+}
+
+/* Locking also faults every page in.  If the lock fails the pages are
+ * touched by hand instead, so at least the first hit won't fault
+ * unless the system is short of memory and swaps them out again. */
+int lock_samples(drmr_sample* samples, int num_samples, int lock) {
+  kit_arena* arena;
+  long page = sysconf(_SC_PAGESIZE);
+  volatile char* p;
+  if (!samples) return 0;
+  arena = get_arena(samples);
+  if (!lock) return munlock(arena,arena->size);
+#ifdef MADV_HUGEPAGE
+  if (arena->size >= 4*1048576) {
+    // only the 2MB aligned interior can use huge pages
+    uintptr_t hstart = ((uintptr_t)arena + 2*1048576-1) & ~(uintptr_t)(2*1048576-1);
+    uintptr_t hend = ((uintptr_t)arena + arena->size) & ~(uintptr_t)(2*1048576-1);
+    if (hend > hstart) madvise((void*)hstart,hend-hstart,MADV_HUGEPAGE);
+  }
+#endif
+  if (!mlock(arena,arena->size)) return 0;
+  {
+    int err = errno;
+    struct rlimit rl;
+    fprintf(stderr,"Couldn't lock kit (%.1f MB) in memory: %s\n",
+	    arena->size/1048576.0,strerror(err));
+    if ((err == ENOMEM || err == EPERM || err == EAGAIN) && !getrlimit(RLIMIT_MEMLOCK,&rl)) {
+      if (rl.rlim_cur == RLIM_INFINITY)
+	fprintf(stderr,"  RLIMIT_MEMLOCK is unlimited, the system is out of lockable memory\n");
+      else
+	fprintf(stderr,"  RLIMIT_MEMLOCK is %.1f MB, raise it (ulimit -l, or limits.conf) to lock whole kits\n",
+		rl.rlim_cur/1048576.0);
+    }
+    fprintf(stderr,"  Samples were prefaulted instead, but may still be swapped out\n");
+  }
+  for (p = (char*)arena;p < (char*)arena+arena->size;p += page)
+    (void)*p;
+  return -1;
+}
+
+void free_samples(drmr_sample* samples, int num_samples) {
+  kit_arena* arena;
+  if (!samples) return;
+  arena = get_arena(samples);
+  __sync_sub_and_fetch(&total_sample_bytes,(long)arena->size);
+  free(arena);
+}
+
 void free_kits(kits* kits) {
   int i;
-  for (i = 0;i < kits->num_kits;i++) {
-    free(kits->kits[i].name);
-    free(kits->kits[i].desc);
-    free(kits->kits[i].path);
-  }
+  for (i = 0;i < kits->num_kits;i++)
+    free_scanned_kit(kits->kits+i);
   free(kits->kits);
   free(kits);
 }
 
-int load_sample(char* path, drmr_layer* layer, double target_rate) {
+// Read the whole file straight into data, which must hold
+// frames*channels floats.  Returns the number of frames read.
+static sf_count_t read_direct(SNDFILE* sndf, SF_INFO* info, float* data,
+			      struct load_stats* ls) {
+  sf_count_t got, total = 0;
+  double start = now_us();
+  while (total < info->frames) {
+    sf_count_t want = info->frames - total;
+    if (want > LOAD_CHUNK_FRAMES) want = LOAD_CHUNK_FRAMES;
+    got = sf_readf_float(sndf,data+(total*info->channels),want);
+    if (got <= 0) break;
+    total += got;
+  }
+  ls->decode_ms += (now_us()-start)/1000.0;
+  return total;
+}
+
+/* Decode and convert in LOAD_CHUNK_FRAMES sized pieces, writing
+ * converted frames directly into out, which has room for out_frames
+ * frames.  This way we never hold more than one full copy of the
+ * sample plus a small scratch buffer.  Returns the number of
+ * frames generated, or -1 on error (with *err set to the
+ * libsamplerate error code, if any) */
+static long convert_streaming(SNDFILE* sndf, SF_INFO* info, double ratio,
+			      float* out, long out_frames, int* err,
+			      struct load_stats* ls) {
+  double t;
+  SRC_STATE* src;
+  SRC_DATA src_data;
+  float* in_buf;
+  long gen = 0;
+  sf_count_t read_total = 0;
+  int eof = 0;
+
+  *err = 0;
+  in_buf = malloc(LOAD_CHUNK_FRAMES*info->channels*sizeof(float));
+  if (!in_buf) return -1;
+  src = src_new(RATE_CONV_QUALITY,info->channels,err);
+  if (!src) {
+    free(in_buf);
+    return -1;
+  }
+
+  src_data.src_ratio = ratio;
+  src_data.input_frames = 0;
+  src_data.data_in = in_buf;
+  while (gen < out_frames) {
+    if (src_data.input_frames == 0 && !eof) {
+      sf_count_t got;
+      t = now_us();
+      got = sf_readf_float(sndf,in_buf,LOAD_CHUNK_FRAMES);
+      ls->decode_ms += (now_us()-t)/1000.0;
+      if (got < 0) got = 0;
+      read_total += got;
+      if (got < LOAD_CHUNK_FRAMES || read_total >= info->frames) eof = 1;
+      src_data.data_in = in_buf;
+      src_data.input_frames = got;
+    }
+    src_data.end_of_input = eof;
+    src_data.data_out = out+(gen*info->channels);
+    src_data.output_frames = out_frames - gen;
+    t = now_us();
+    *err = src_process(src,&src_data);
+    ls->resample_ms += (now_us()-t)/1000.0;
+    if (*err) {
+      gen = -1;
+      break;
+    }
+    gen += src_data.output_frames_gen;
+    src_data.data_in += src_data.input_frames_used*info->channels;
+    src_data.input_frames -= src_data.input_frames_used;
+    if (eof && src_data.input_frames == 0 && src_data.output_frames_gen == 0)
+      break; // converter is drained
+  }
+
+  if (gen >= 0 && gen < out_frames && read_total != info->frames)
+    fprintf(stderr,"Didn't consume all input frames. used: %li  had: %li  gened: %li\n",
+	    (long)read_total,(long)info->frames,gen);
+
+  src_delete(src);
+  free(in_buf);
+  return gen;
+}
+
+/* Cut the near silence off both ends of a layer: the frames before the
+ * first and after the last one that gets within trim_db of the layer's
+ * peak.  Voices then neither wait through leading silence nor go on
+ * mixing an inaudible tail.  Returns the number of frames cut. */
+static long trim_silence(drmr_layer* layer, int trim_db) {
+  long frames = layer->info->frames, first, last, keep, i;
+  int c, ch = layer->info->channels;
+  float peak = 0.0f, thresh;
+  float* data = layer->data;
+  if (trim_db <= TRIM_MIN || frames == 0) return 0;
+  for (i = 0;i < frames*ch;i++)
+    if (fabsf(data[i]) > peak) peak = fabsf(data[i]);
+  if (peak == 0.0f) return 0; // all silence, leave it be
+  thresh = peak*powf(10.0f,trim_db*0.05f);
+  for (first = 0;first < frames;first++) {
+    for (c = 0;c < ch && fabsf(data[first*ch+c]) < thresh;c++);
+    if (c < ch) break;
+  }
+  for (last = frames-1;last > first;last--) {
+    for (c = 0;c < ch && fabsf(data[last*ch+c]) < thresh;c++);
+    if (c < ch) break;
+  }
+  keep = last-first+1;
+  if (keep == frames) return 0;
+  if (first > 0)
+    memmove(data,data+first*ch,keep*ch*sizeof(float));
+  data = realloc(layer->data,keep*ch*sizeof(float));
+  if (data) layer->data = data;
+  layer->info->frames = keep;
+  layer->limit = keep*ch;
+  return frames-keep;
+}
+
+// rms of the loudest 50ms of a layer, over all its channels
+static float loudest_rms(drmr_layer* layer) {
+  long frames = layer->info->frames, w, i;
+  int c, ch = layer->info->channels;
+  float* data = layer->data;
+  double sum = 0.0, best = 0.0;
+  w = (long)(layer->info->samplerate*0.05);
+  if (w > frames) w = frames;
+  if (w < 1) return 0.0f;
+  for (i = 0;i < frames;i++) {
+    for (c = 0;c < ch;c++)
+      sum += (double)data[i*ch+c]*data[i*ch+c];
+    if (i >= w)
+      for (c = 0;c < ch;c++)
+	sum -= (double)data[(i-w)*ch+c]*data[(i-w)*ch+c];
+    if (i >= w-1 && sum > best) best = sum;
+  }
+  return (float)sqrt(best/(w*ch));
+}
+
+/* Normalize a layer as set by normalize, then scale it by gain, so
+ * neither costs anything when it plays.  Silent layers aren't
+ * normalized.  Returns the factor the data was multiplied by. */
+static float bake_gain(drmr_layer* layer, int normalize, float gain) {
+  long i, n = layer->limit;
+  float* data = layer->data;
+  float level = 0.0f;
+  if (normalize == NORMALIZE_PEAK) {
+    for (i = 0;i < n;i++)
+      if (fabsf(data[i]) > level) level = fabsf(data[i]);
+    if (level > 0.0f) gain /= level;
+  } else if (normalize == NORMALIZE_LOUDNESS) {
+    level = loudest_rms(layer);
+    if (level > 0.0f) gain *= powf(10.0f,NORMALIZE_RMS_DB*0.05f)/level;
+  }
+  if (gain != 1.0f)
+    for (i = 0;i < n;i++) data[i] *= gain;
+  return gain;
+}
+
+/* load_sample, adding what it did to ls and the trace.  Silence is
+ * trimmed with trim_silence() and the gain baked in with bake_gain(). */
+static int load_sample_stats(char* path, drmr_layer* layer, double target_rate,
+			     int trim_db, int normalize, float gain,
+			     struct load_stats* ls) {
   SNDFILE* sndf;
   long size;
+  double start = now_us(), t;
+  struct load_stats before = *ls;
+  struct stat st;
+  int orig_rate;
+  long trimmed;
   
   //printf("Loading: %s\n",path);
 
+  if (!stat(path,&st)) ls->file_bytes += st.st_size;
   layer->info = malloc(sizeof(SF_INFO));
   memset(layer->info,0,sizeof(SF_INFO));
   sndf = sf_open(path,SFM_READ,layer->info);
+  ls->open_ms += (now_us()-start)/1000.0;
   
   if (!sndf) {
     fprintf(stderr,"Failed to open sound file: %s - %s\n",path,sf_strerror(sndf));
@@ -402,60 +1089,216 @@ int load_sample(char* path, drmr_layer* layer, double target_rate) {
 
   if (layer->info->channels > 2) {
     fprintf(stderr, "File has too many channels.  Can only handle mono/stereo samples\n");
+    sf_close(sndf);
     free(layer->info);
     return 1;
   }
+  orig_rate = layer->info->samplerate;
+
+  // convert rate if needed
+  if (layer->info->samplerate != target_rate) {
+    int stat;
+    double ratio = (target_rate/layer->info->samplerate);
+    long out_frames = (long)ceil(layer->info->frames * ratio);
+    long gen;
+
+    t = now_us();
+    layer->data = malloc(out_frames*layer->info->channels*sizeof(float));
+    ls->alloc_ms += (now_us()-t)/1000.0;
+    if (!layer->data) {
+      fprintf(stderr,"Failed to allocate sample memory for %s\n",path);
+      sf_close(sndf);
+      free(layer->info);
+      return 1;
+    }
+
+    gen = convert_streaming(sndf,layer->info,ratio,layer->data,out_frames,&stat,ls);
+    if (gen >= 0) {
+      sf_close(sndf);
+      if (gen < out_frames && gen > 0) {
+	// trim the estimate down to what was actually produced
+	float* trimmed = realloc(layer->data,gen*layer->info->channels*sizeof(float));
+	if (trimmed) layer->data = trimmed;
+      }
+      layer->limit = gen*layer->info->channels;
+      layer->info->samplerate = target_rate;
+      layer->info->frames = gen;
+      goto done;
+    }
+
+    fprintf(stderr,"Failed to convert rate for %s: %s.  Using original rate\n",
+	    path,stat?src_strerror(stat):"out of memory");
+    free(layer->data);
+    layer->data = NULL;
+    sf_seek(sndf,0,SEEK_SET);
+  }
 
   size = layer->info->frames * layer->info->channels;
-  layer->limit = size;
+  t = now_us();
   layer->data = malloc(size*sizeof(float));
+  ls->alloc_ms += (now_us()-t)/1000.0;
   if (!layer->data) {
     fprintf(stderr,"Failed to allocate sample memory for %s\n",path);
+    sf_close(sndf);
     free(layer->info);
     return 1;
   }
 
-  sf_read_float(sndf,layer->data,size);
+  layer->info->frames = read_direct(sndf,layer->info,layer->data,ls);
+  layer->limit = layer->info->frames * layer->info->channels;
   sf_close(sndf); 
 
-  // convert rate if needed
-  if (layer->info->samplerate != target_rate) {
-    SRC_DATA src_data;
-    int stat;
-    double ratio = (target_rate/layer->info->samplerate);
-    long out_frames = (long)ceil(layer->info->frames * ratio);
-    long out_size = out_frames*layer->info->channels;
-    float *data_out = malloc(sizeof(float)*out_size);
-
-    src_data.data_in = layer->data;
-    src_data.input_frames = layer->info->frames;
-    src_data.data_out = data_out;
-    src_data.output_frames = out_frames;
-    src_data.src_ratio = ratio;
-
-    stat = src_simple(&src_data,RATE_CONV_QUALITY,layer->info->channels);
-    if (stat) {
-      fprintf(stderr,"Failed to convert rate for %s: %s.  Using original rate\n",
-	      path,src_strerror(stat));
-      free(data_out);
-      return 0;
-    }
+ done:
+  trimmed = trim_silence(layer,trim_db);
+  gain = bake_gain(layer,normalize,gain);
+  ls->trim_bytes += trimmed*layer->info->channels*sizeof(float);
+  ls->alloc_bytes += layer->limit*sizeof(float) + sizeof(SF_INFO);
+  ls->layers++;
+  if (trace_enabled()) {
+    char extra[512];
+    snprintf(extra,512,"\"frames\": %li, \"trimmed_frames\": %li, \"gain\": %.4f, "
+	     "\"channels\": %i, \"file_rate\": %i, \"file_bytes\": %li, \"alloc_bytes\": %li, \"open_ms\": %.3f, "
+	     "\"alloc_ms\": %.3f, \"decode_ms\": %.3f, \"resample_ms\": %.3f",
+	     (long)layer->info->frames,trimmed,gain,layer->info->channels,orig_rate,
+	     ls->file_bytes-before.file_bytes,ls->alloc_bytes-before.alloc_bytes,
+	     ls->open_ms-before.open_ms,ls->alloc_ms-before.alloc_ms,
+	     ls->decode_ms-before.decode_ms,ls->resample_ms-before.resample_ms);
+    trace_event("load","load_layer",start,now_us(),path,extra);
+  }
+  return 0;
+}
 
-    if (src_data.input_frames_used != layer->info->frames)
-      fprintf(stderr,"Didn't consume all input frames. used: %li  had: %li  gened: %li\n",
-	      src_data.input_frames_used, layer->info->frames,src_data.output_frames_gen);
+int load_sample(char* path, drmr_layer* layer, double target_rate) {
+  struct load_stats ls;
+  memset(&ls,0,sizeof(struct load_stats));
+  return load_sample_stats(path,layer,target_rate,TRIM_MIN,NORMALIZE_OFF,1.0f,&ls);
+}
 
-    free(layer->data);
+// frames a file will have at rate, or 0 if it can't be loaded
+static long estimate_frames(char* path, double rate, int* channels) {
+  SF_INFO info;
+  SNDFILE* sndf;
+  memset(&info,0,sizeof(SF_INFO));
+  *channels = 0;
+  sndf = sf_open(path,SFM_READ,&info);
+  if (!sndf) return 0;
+  sf_close(sndf);
+  if (info.channels > 2) return 0;
+  *channels = info.channels;
+  if (info.samplerate != rate)
+    return (long)ceil(info.frames*(rate/info.samplerate));
+  return info.frames;
+}
 
-    layer->data = data_out;
-    layer->limit = src_data.output_frames_gen*layer->info->channels;
-    layer->info->samplerate = target_rate;
-    layer->info->frames = src_data.output_frames_gen;
+static int cmp_layer_min(const void* a, const void* b) {
+  float x = (*(struct instrument_layer**)a)->min;
+  float y = (*(struct instrument_layer**)b)->min;
+  return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+/* Keep at most keep layers of the instrument, spread evenly over its
+ * velocity range and always including the loudest one.  If apply is
+ * set, kept layers have their ranges widened down to cover the dropped
+ * ones.  Returns the bytes the kept layers will use. */
+static long plan_layers(struct instrument_info* inst, int keep, int apply) {
+  struct instrument_layer *cur_l, *sorted[128];
+  int n = 0, j, prev = -1;
+  long bytes = 0;
+  for (cur_l = inst->layers;cur_l && n < 128;cur_l = cur_l->next) {
+    cur_l->skip = 1;
+    sorted[n++] = cur_l;
+  }
+  for (;cur_l;cur_l = cur_l->next) cur_l->skip = 1; // absurd layer counts
+  qsort(sorted,n,sizeof(struct instrument_layer*),cmp_layer_min);
+  if (keep > n) keep = n;
+  for (j = 0;j < keep;j++) {
+    int idx = ((j+1)*n + keep-1)/keep - 1;
+    struct instrument_layer* l = sorted[idx];
+    l->skip = 0;
+    if (apply && prev >= 0 && idx > prev+1)
+      l->min = sorted[prev]->max;
+    else if (apply && prev < 0 && idx > 0)
+      l->min = sorted[0]->min;
+    bytes += l->est_frames*l->channels*sizeof(float);
+    prev = idx;
+  }
+  return bytes;
+}
+
+/* Work out how to fit the kit into budget bytes of sample memory by
+ * dropping velocity layers, down to one per instrument.  Returns 0 if
+ * the kit fits, -1 if it doesn't even then. */
+static int plan_kit_budget(struct kit_info* kit, char* path, double rate, size_t budget) {
+  char buf[BUFSIZ];
+  struct instrument_info* cur_i;
+  struct instrument_layer* cur_l;
+  long fixed = 0, total;
+  int max_layers = 0, keep;
+
+  for (cur_i = kit->instruments;cur_i;cur_i = cur_i->next) {
+    int count = 0;
+    if (cur_i->filename) {
+      snprintf(buf,BUFSIZ,"%s/%s",path,cur_i->filename);
+      cur_i->est_frames = estimate_frames(buf,rate,&cur_i->channels);
+      fixed += cur_i->est_frames*cur_i->channels*sizeof(float);
+    } else {
+      for (cur_l = cur_i->layers;cur_l;cur_l = cur_l->next) {
+	snprintf(buf,BUFSIZ,"%s/%s",path,cur_l->filename);
+	cur_l->est_frames = estimate_frames(buf,rate,&cur_l->channels);
+	count++;
+      }
+    }
+    if (count > max_layers) max_layers = count;
+  }
+
+  total = fixed;
+  for (keep = max_layers;keep >= 1;keep--) {
+    total = fixed;
+    for (cur_i = kit->instruments;cur_i;cur_i = cur_i->next)
+      if (!cur_i->filename && cur_i->layers)
+	total += plan_layers(cur_i,keep,0);
+    if (total <= budget || keep == 1) break;
+  }
+  if (total > budget) {
+    // cutting samples short would change how the kit sounds, so don't
+    fprintf(stderr,"Kit is %.1f MB even with one layer per instrument, "
+	    "over the %.1f MB memory budget, not loading it\n",
+	    total/1048576.0,budget/1048576.0);
+    return -1;
+  }
+  if (keep >= 1 && keep < max_layers) {
+    fprintf(stderr,"Loading at most %i of %i velocity layers to fit the %.1f MB memory budget\n",
+	    keep,max_layers,budget/1048576.0);
+    for (cur_i = kit->instruments;cur_i;cur_i = cur_i->next)
+      if (!cur_i->filename && cur_i->layers)
+	plan_layers(cur_i,keep,1);
   }
   return 0;
 }
 
-drmr_sample* load_hydrogen_kit(char *path, double rate, int *num_samples) {
+// free what parsing a kit's xml allocated
+static void free_kit_info(struct kit_info* kit) {
+  struct instrument_info* cur_i = kit->instruments;
+  while (cur_i) {
+    struct instrument_info* next_i = cur_i->next;
+    struct instrument_layer* cur_l = cur_i->layers;
+    while (cur_l) {
+      struct instrument_layer* next_l = cur_l->next;
+      free(cur_l->filename);
+      free(cur_l);
+      cur_l = next_l;
+    }
+    free(cur_i->name);
+    free(cur_i->filename);
+    free(cur_i);
+    cur_i = next_i;
+  }
+  free(kit->name);
+  free(kit->desc);
+}
+
+drmr_sample* load_hydrogen_kit(char *path, double rate, size_t mem_budget, int trim_db,
+				int normalize, volatile int* cancel, int *num_samples) {
   FILE* file;
   char buf[BUFSIZ];
   XML_Parser parser;
@@ -465,6 +1308,11 @@ drmr_sample* load_hydrogen_kit(char *path, double rate, int *num_samples) {
   drmr_sample *samples;
   struct instrument_info * cur_i, *i_to_free;
   int i = 0, num_inst = 0;
+  struct load_stats ls;
+  double start = now_us(), parsed;
+  int cancelled = 0;
+
+  memset(&ls,0,sizeof(struct load_stats));
 
   snprintf(buf,BUFSIZ,"%s/drumkit.xml",path);
   
@@ -494,10 +1342,15 @@ drmr_sample* load_hydrogen_kit(char *path, double rate, int *num_samples) {
               "%s at line %lu\n",
               XML_ErrorString(XML_GetErrorCode(parser)),
               XML_GetCurrentLineNumber(parser));
+      XML_ParserFree(parser);
+      fclose(file);
       return NULL;
     }
   } while (!done);
   XML_ParserFree(parser);
+  fclose(file);
+  parsed = now_us();
+  trace_event("load","parse_xml",start,parsed,path,NULL);
 
   printf("Read kit: %s\n",kit_info.name);
   cur_i = kit_info.instruments;
@@ -506,6 +1359,10 @@ drmr_sample* load_hydrogen_kit(char *path, double rate, int *num_samples) {
     cur_i = cur_i->next;
   }
   printf("Loading %i instruments\n",num_inst);
+  if (mem_budget > 0 && plan_kit_budget(&kit_info,path,rate,mem_budget)) {
+    free_kit_info(&kit_info);
+    return NULL;
+  }
   samples = malloc(num_inst*sizeof(drmr_sample));
   cur_i = kit_info.instruments;
   while(cur_i) {
@@ -514,8 +1371,10 @@ drmr_sample* load_hydrogen_kit(char *path, double rate, int *num_samples) {
       layer->min = 0;
       layer->max = 1;
       snprintf(buf,BUFSIZ,"%s/%s",path,cur_i->filename);
-      if (load_sample(buf,layer,rate)) {
-	fprintf(stderr,"Could not load sample: %s\n",buf);
+      if (cancel && *cancel) cancelled = 1;
+      if (cancelled ||
+	  load_sample_stats(buf,layer,rate,trim_db,normalize,cur_i->gain,&ls)) {
+	if (!cancelled) fprintf(stderr,"Could not load sample: %s\n",buf);
 	// set limit to zero, will never try and play
 	layer->info = NULL;
 	layer->limit = 0;
@@ -533,7 +1392,7 @@ drmr_sample* load_hydrogen_kit(char *path, double rate, int *num_samples) {
       int j;
       struct instrument_layer *cur_l = cur_i->layers;
       while(cur_l) {
-	layer_count++;
+	if (!cur_l->skip) layer_count++;
 	cur_l = cur_l->next;
       }
       samples[i].layer_count = layer_count;
@@ -541,9 +1400,15 @@ drmr_sample* load_hydrogen_kit(char *path, double rate, int *num_samples) {
       cur_l = cur_i->layers;
       j = 0;
       while(cur_l) {
+	if (cur_l->skip) {
+	  cur_l = cur_l->next;
+	  continue;
+	}
 	snprintf(buf,BUFSIZ,"%s/%s",path,cur_l->filename);
-	if (load_sample(buf,samples[i].layers+j,rate)) {
-	  fprintf(stderr,"Could not load sample: %s\n",buf);
+	if (cancel && *cancel) cancelled = 1;
+	if (cancelled ||
+	    load_sample_stats(buf,samples[i].layers+j,rate,trim_db,normalize,cur_i->gain*cur_l->gain,&ls)) {
+	  if (!cancelled) fprintf(stderr,"Could not load sample: %s\n",buf);
 	  // set limit to zero, will never try and play
 	  samples[i].layers[j].info = NULL;
 	  samples[i].layers[j].limit = 0;
@@ -578,6 +1443,32 @@ drmr_sample* load_hydrogen_kit(char *path, double rate, int *num_samples) {
     free(i_to_free);
     i++;
   }
+  if (cancelled) {
+    printf("Cancelled loading %s after %.0f ms\n",
+	   kit_info.name?kit_info.name:path,(now_us()-start)/1000.0);
+    free_loose_samples(samples,num_inst);
+    if (kit_info.name) free(kit_info.name);
+    *num_samples = 0;
+    return NULL;
+  }
+  samples = pack_samples(samples,num_inst);
+  if (!samples) num_inst = 0;
+  printf("Loaded %s: %i layers, %.1f MB read, %.1f MB allocated (%.1f MB of silence trimmed) "
+	 "in %.0f ms (parse %.1f, open %.1f, alloc %.1f, decode %.1f, resample %.1f), "
+	 "%.1f MB of samples loaded in total\n",
+	 kit_info.name?kit_info.name:path,ls.layers,ls.file_bytes/1048576.0,
+	 ls.alloc_bytes/1048576.0,ls.trim_bytes/1048576.0,(now_us()-start)/1000.0,
+	 (parsed-start)/1000.0,ls.open_ms,ls.alloc_ms,ls.decode_ms,ls.resample_ms,
+	 total_sample_memory()/1048576.0);
+  if (trace_enabled()) {
+    char extra[512];
+    snprintf(extra,512,"\"instruments\": %i, \"layers\": %i, \"file_bytes\": %li, "
+	     "\"alloc_bytes\": %li, \"trim_bytes\": %li, \"parse_ms\": %.3f, \"open_ms\": %.3f, "
+	     "\"alloc_ms\": %.3f, \"decode_ms\": %.3f, \"resample_ms\": %.3f",
+	     num_inst,ls.layers,ls.file_bytes,ls.alloc_bytes,ls.trim_bytes,(parsed-start)/1000.0,
+	     ls.open_ms,ls.alloc_ms,ls.decode_ms,ls.resample_ms);
+    trace_event("load","load_kit",start,now_us(),path,extra);
+  }
   if (kit_info.name) free(kit_info.name);
   *num_samples = num_inst;
   return samples;
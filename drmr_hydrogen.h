@@ -19,9 +19,44 @@
 #define DRMR_HYDRO_H
 
 kits* scan_kits();
+kits* scan_kit_dirs(char** locations);
 void free_kits(kits* kits);
+
+/* Watch the kit locations for kits being added, edited or removed.
+ * update_kits() applies whatever has changed since the last call to
+ * kits without blocking, keeping existing indices, and returns how
+ * many kits changed.  kit_watch_fd() becomes readable when there is
+ * something to update, for use in a main loop.  watch_kits() returns
+ * NULL if watching isn't possible. */
+typedef struct kit_watch kit_watch;
+kit_watch* watch_kits();
+int kit_watch_fd(kit_watch* w);
+int update_kits(kit_watch* w, kits* kits);
+void free_kit_watch(kit_watch* w);
 void free_samples(drmr_sample* samples, int num_samples);
 int load_sample(char* path,drmr_layer* layer,double target_rate);
-drmr_sample *load_hydrogen_kit(char *path, double rate, int *num_samples);
+/* mem_budget is the most sample memory to use in bytes, 0 for no limit.
+ * Frames quieter than trim_db below a layer's peak are cut off its
+ * start and end, TRIM_MIN keeps them all.  Each layer is normalized
+ * as set by normalize (one of the NORMALIZE_ values) and then scaled by
+ * the kit's layer and instrument gains.  If cancel is non-NULL it is
+ * checked before each sample is loaded, and once it's set the load is
+ * abandoned and NULL returned. */
+drmr_sample *load_hydrogen_kit(char *path, double rate, size_t mem_budget, int trim_db,
+			       int normalize, volatile int* cancel, int *num_samples);
+
+// memory accounting, in bytes
+size_t kit_memory(drmr_sample* samples, int num_samples);
+size_t total_sample_memory();
+
+/* Move a kit built out of separate mallocs (samples, layers, infos
+ * and data) into a single arena, freeing the pieces.  Every kit handed
+ * to the plugin or free_samples must have been through this.  Returns
+ * NULL (with the pieces freed) if the arena couldn't be allocated. */
+drmr_sample* pack_samples(drmr_sample* samples, int num_samples);
+
+// lock != 0: mlock and prefault the kit's arena, reporting failures.
+// lock == 0: munlock it again.  Returns -1 if locking failed.
+int lock_samples(drmr_sample* samples, int num_samples, int lock);
 
 #endif // DRMR_HYDRO_H
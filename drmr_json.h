@@ -0,0 +1,45 @@
+/* drmr_json.h
+ * LV2 DrMr plugin
+ * Copyright 2012 Nick Lanham <nick@afternight.org>
+ *
+ * Public License v3. source code is available at
+ * <http://github.com/nicklan/drmr>
+
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+// JSON output for the benchmark programs
+
+#ifndef DRMR_JSON_H
+#define DRMR_JSON_H
+
+#include <stdio.h>
+
+/* Write s to out as a JSON string, quotes included.  Paths and kit
+ * names can hold quotes, backslashes and control characters, anything
+ * else is passed through as is (so should be UTF-8). */
+static inline void json_string(FILE* out, const char* s) {
+  fputc('"',out);
+  for (;*s;s++) {
+    unsigned char c = (unsigned char)*s;
+    if (c == '"' || c == '\\')
+      fprintf(out,"\\%c",c);
+    else if (c == '\n')
+      fputs("\\n",out);
+    else if (c == '\t')
+      fputs("\\t",out);
+    else if (c < 0x20)
+      fprintf(out,"\\u%04x",c);
+    else
+      fputc(c,out);
+  }
+  fputc('"',out);
+}
+
+#endif // DRMR_JSON_H
@@ -0,0 +1,198 @@
+/* drmr_kitbench.c
+ * LV2 DrMr plugin
+ * Copyright 2012 Nick Lanham <nick@afternight.org>
+ *
+ * Public License v3. source code is available at
+ * <http://github.com/nicklan/drmr>
+
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Times scan_kit_dirs() and load_hydrogen_kit() against a kit tree,
+ * usually one made by drmr_kitgen.
+ *
+ * A cold run first asks the kernel to drop the tree's files from the
+ * page cache (fdatasync then posix_fadvise, no root needed), a warm run
+ * just repeats the operation.  The kernel is free to ignore the advice,
+ * so cold times are best effort, the JSON says so and counts the files
+ * that couldn't even be advised.  Results are written as one JSON
+ * object.
+ */
+
+#define _XOPEN_SOURCE 600
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "drmr.h"
+#include "drmr_hydrogen.h"
+#include "drmr_json.h"
+
+static inline double now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec*1000.0 + ts.tv_nsec/1000000.0;
+}
+
+static int cmp_double(const void* a, const void* b) {
+  double x = *(const double*)a, y = *(const double*)b;
+  return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+/* Drop every file under path from the page cache, returning how many
+ * files that failed for.  Dirty pages aren't dropped, so they're
+ * written out first. */
+static int evict_tree(char* path) {
+  DIR* dp;
+  struct dirent* ep;
+  struct stat st;
+  char buf[BUFSIZ];
+  int failed = 0;
+  if (!(dp = opendir(path))) return 1;
+  while ((ep = readdir(dp))) {
+    if (ep->d_name[0] == '.') continue;
+    snprintf(buf,BUFSIZ,"%s/%s",path,ep->d_name);
+    if (stat(buf,&st)) continue;
+    if (S_ISDIR(st.st_mode))
+      failed += evict_tree(buf);
+    else if (S_ISREG(st.st_mode)) {
+      int fd = open(buf,O_RDONLY);
+      if (fd < 0 || fdatasync(fd) || posix_fadvise(fd,0,0,POSIX_FADV_DONTNEED))
+	failed++;
+      if (fd >= 0) close(fd);
+    }
+  }
+  closedir(dp);
+  return failed;
+}
+
+static double median(double* vals, int n) {
+  qsort(vals,n,sizeof(double),cmp_double);
+  return vals[n/2];
+}
+
+static void usage(char* prog) {
+  fprintf(stderr,
+	  "Usage: %s [options] kits_dir\n"
+	  "  -n count    warm repetitions (default 5)\n"
+	  "  -r rate     rate to load kits at (default 48000)\n"
+	  "  -k index    only time loading this kit (default all)\n"
+	  "  -m MB       memory budget to load kits with (default unlimited)\n"
+	  "  -t dB       trim silence below this many dB from the peak (default %i, %i is off)\n"
+	  "  -N mode     normalize layers: 0 off, 1 peak, 2 loudness (default 0)\n"
+	  "  -o file     write the JSON result to file instead of stdout\n",
+	  prog,TRIM_DEFAULT,TRIM_MIN);
+}
+
+int main(int argc, char* argv[]) {
+  char* dirs[2];
+  kits* kits;
+  double rate = 48000;
+  int reps = 5, only = -1;
+  size_t budget = 0;
+  int trim = TRIM_DEFAULT, normalize = NORMALIZE_OFF;
+  int c,i,r,num_samples,first = 1,evict_failed;
+  char* out_path = NULL;
+  FILE* out;
+  double cold,t,med,*warm;
+  drmr_sample* samples;
+
+  while ((c = getopt(argc,argv,"n:r:k:m:t:N:o:h")) != -1) {
+    switch (c) {
+    case 'n': reps = atoi(optarg); break;
+    case 'r': rate = atof(optarg); break;
+    case 'k': only = atoi(optarg); break;
+    case 'm': budget = (size_t)(atof(optarg)*1048576); break;
+    case 't': trim = atoi(optarg); break;
+    case 'N': normalize = atoi(optarg); break;
+    case 'o': out_path = optarg; break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (optind != argc-1 || reps < 1 || rate <= 0) {
+    usage(argv[0]);
+    return 1;
+  }
+  dirs[0] = argv[optind];
+  dirs[1] = NULL;
+  warm = malloc(reps*sizeof(double));
+
+  // scanning
+  evict_failed = evict_tree(dirs[0]);
+  t = now_ms();
+  kits = scan_kit_dirs(dirs);
+  cold = now_ms()-t;
+  for (r = 0;r < reps;r++) {
+    free_kits(kits);
+    t = now_ms();
+    kits = scan_kit_dirs(dirs);
+    warm[r] = now_ms()-t;
+  }
+
+  med = median(warm,reps); // sorts warm, so warm[0] is the min
+
+  out = out_path?fopen(out_path,"w"):stdout;
+  if (!out) {
+    perror("Unable to open output file");
+    return 1;
+  }
+  fprintf(out,"{\"dir\": ");
+  json_string(out,dirs[0]);
+  fprintf(out,", \"rate\": %.0f, \"repetitions\": %i, \"trim_db\": %i, "
+	  "\"normalize\": %i, \"scan\": {\"kits\": %i, \"cold_ms\": %.3f, \"warm_ms_median\": %.3f, \"warm_ms_min\": %.3f}, "
+	  "\"loads\": [",
+	  rate,reps,trim,normalize,kits->num_kits,cold,med,warm[0]);
+
+  // loading
+  for (i = 0;i < kits->num_kits;i++) {
+    long bytes;
+    if (only >= 0 && i != only) continue;
+    evict_failed += evict_tree(kits->kits[i].path);
+    t = now_ms();
+    samples = load_hydrogen_kit(kits->kits[i].path,rate,budget,trim,normalize,NULL,
+				&num_samples);
+    cold = now_ms()-t;
+    if (!samples) {
+      fprintf(stderr,"Failed to load %s\n",kits->kits[i].path);
+      continue;
+    }
+    bytes = (long)kit_memory(samples,num_samples);
+    free_samples(samples,num_samples);
+    for (r = 0;r < reps;r++) {
+      t = now_ms();
+      samples = load_hydrogen_kit(kits->kits[i].path,rate,budget,trim,normalize,NULL,
+				  &num_samples);
+      warm[r] = now_ms()-t;
+      if (samples) free_samples(samples,num_samples);
+    }
+    med = median(warm,reps);
+    fprintf(out,"%s{\"kit\": ",first?"":", ");
+    json_string(out,kits->kits[i].name);
+    fprintf(out,", \"instruments\": %i, \"bytes\": %li, "
+	    "\"cold_ms\": %.3f, \"warm_ms_median\": %.3f, \"warm_ms_min\": %.3f}",
+	    num_samples,bytes,cold,med,warm[0]);
+    first = 0;
+  }
+  fprintf(out,"], \"cold_eviction\": {\"method\": \"fdatasync+posix_fadvise\", "
+	  "\"best_effort\": true, \"failed_files\": %i}}\n",evict_failed);
+
+  if (out != stdout) fclose(out);
+  free_kits(kits);
+  free(warm);
+  return 0;
+}
@@ -0,0 +1,227 @@
+/* drmr_kitgen.c
+ * LV2 DrMr plugin
+ * Copyright 2012 Nick Lanham <nick@afternight.org>
+ *
+ * Public License v3. source code is available at
+ * <http://github.com/nicklan/drmr>
+
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Generates trees of synthetic hydrogen drum kits.
+ *
+ * Each kit gets its own directory holding a drumkit.xml and one sound
+ * file per instrument layer, so the output directory can be handed to
+ * scan_kit_dirs() or load_hydrogen_kit() just like a real kit
+ * location.  Everything is derived from a seed, so the same options
+ * always produce the same tree.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <sndfile.h>
+
+struct kitgen_opts {
+  char* out_dir;
+  int kits;
+  int instruments;
+  int layers;        // 0 means old style, one filename per instrument
+  float sample_secs;
+  int rate;
+  int channels;
+  int flac;
+  unsigned int seed;
+};
+
+static unsigned int rand_state;
+static unsigned int kitgen_rand() {
+  rand_state = rand_state*1103515245 + 12345;
+  return (rand_state>>16)&0x7fff;
+}
+
+static int make_dir(char* path) {
+  if (mkdir(path,0755) && errno != EEXIST) {
+    fprintf(stderr,"Couldn't create %s: %s\n",path,strerror(errno));
+    return 1;
+  }
+  return 0;
+}
+
+/* Write a decaying tone plus noise, pitched by instrument and scaled
+ * by layer so the different layers are distinguishable. */
+static int write_sample(char* path, struct kitgen_opts* opts, int inst, int layer) {
+  SF_INFO info;
+  SNDFILE* sndf;
+  long frames = (long)(opts->sample_secs*opts->rate);
+  long i;
+  int c;
+  float* buf;
+  float freq = 60.0f*(1+inst);
+  float amp = (layer+1.0f)/(opts->layers>0?opts->layers:1);
+  float decay = 6.0f/(frames>0?frames:1);
+
+  memset(&info,0,sizeof(SF_INFO));
+  info.samplerate = opts->rate;
+  info.channels = opts->channels;
+  info.format = opts->flac?(SF_FORMAT_FLAC|SF_FORMAT_PCM_16):(SF_FORMAT_WAV|SF_FORMAT_PCM_16);
+  sndf = sf_open(path,SFM_WRITE,&info);
+  if (!sndf) {
+    fprintf(stderr,"Couldn't create %s: %s\n",path,sf_strerror(NULL));
+    return 1;
+  }
+
+  buf = malloc(frames*opts->channels*sizeof(float));
+  for (i = 0;i < frames;i++) {
+    float env = amp*expf(-decay*i);
+    float tone = sinf(2*M_PI*freq*i/opts->rate);
+    for (c = 0;c < opts->channels;c++) {
+      float noise = ((float)kitgen_rand()/0x3fff)-1.0f;
+      buf[i*opts->channels+c] = 0.8f*env*(0.7f*tone+0.3f*noise);
+    }
+  }
+  sf_writef_float(sndf,buf,frames);
+  sf_close(sndf);
+  free(buf);
+  return 0;
+}
+
+// dir/name into out, BUFSIZ long.  1 if it doesn't fit.
+static int join_path(char* out, const char* dir, const char* name) {
+  if (snprintf(out,BUFSIZ,"%s/%s",dir,name) >= BUFSIZ) {
+    fprintf(stderr,"Path too long: %s/%s\n",dir,name);
+    return 1;
+  }
+  return 0;
+}
+
+static int write_kit(struct kitgen_opts* opts, int kit) {
+  char kit_dir[BUFSIZ], path[BUFSIZ], fname[64];
+  const char* ext = opts->flac?"flac":"wav";
+  FILE* xml;
+  int i,l;
+
+  snprintf(fname,64,"synth_kit_%03i",kit);
+  if (join_path(kit_dir,opts->out_dir,fname) || make_dir(kit_dir) ||
+      join_path(path,kit_dir,"drumkit.xml"))
+    return 1;
+  xml = fopen(path,"w");
+  if (!xml) {
+    fprintf(stderr,"Couldn't create %s: %s\n",path,strerror(errno));
+    return 1;
+  }
+
+  fprintf(xml,"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+	  "<drumkit_info>\n"
+	  " <name>Synthetic Kit %03i</name>\n"
+	  " <author>drmr_kitgen</author>\n"
+	  " <info>%i instruments, %i layers, %.2fs %i channel samples at %iHz</info>\n"
+	  " <license>GPL</license>\n"
+	  " <instrumentList>\n",
+	  kit,opts->instruments,opts->layers,opts->sample_secs,opts->channels,opts->rate);
+  for (i = 0;i < opts->instruments;i++) {
+    fprintf(xml,"  <instrument>\n"
+	    "   <id>%i</id>\n"
+	    "   <name>Synth %i</name>\n"
+	    "   <volume>1</volume>\n"
+	    "   <isMuted>false</isMuted>\n"
+	    "   <pan_L>1</pan_L>\n"
+	    "   <pan_R>1</pan_R>\n",
+	    i,i);
+    if (opts->layers == 0) {
+      snprintf(fname,64,"inst_%03i.%s",i,ext);
+      if (join_path(path,kit_dir,fname) || write_sample(path,opts,i,0)) goto fail;
+      fprintf(xml,"   <filename>%s</filename>\n",fname);
+    }
+    for (l = 0;l < opts->layers;l++) {
+      snprintf(fname,64,"inst_%03i_layer_%02i.%s",i,l,ext);
+      if (join_path(path,kit_dir,fname) || write_sample(path,opts,i,l)) goto fail;
+      fprintf(xml,"   <layer>\n"
+	      "    <filename>%s</filename>\n"
+	      "    <min>%f</min>\n"
+	      "    <max>%f</max>\n"
+	      "    <gain>1</gain>\n"
+	      "    <pitch>0</pitch>\n"
+	      "   </layer>\n",
+	      fname,(float)l/opts->layers,(float)(l+1)/opts->layers);
+    }
+    fprintf(xml,"  </instrument>\n");
+  }
+  fprintf(xml," </instrumentList>\n</drumkit_info>\n");
+  fclose(xml);
+  return 0;
+
+ fail:
+  fclose(xml);
+  return 1;
+}
+
+static void usage(char* prog) {
+  fprintf(stderr,
+	  "Usage: %s [options] out_dir\n"
+	  "  -k count    number of kits (default 4)\n"
+	  "  -i count    instruments per kit (default 16)\n"
+	  "  -l count    layers per instrument, 0 for a single top level file (default 4)\n"
+	  "  -d secs     sample length (default 1.0)\n"
+	  "  -r rate     sample rate of the files (default 44100)\n"
+	  "  -c chans    channels, 1 or 2 (default 2)\n"
+	  "  -f          write FLAC instead of WAV\n"
+	  "  -s seed     random seed (default 1)\n",
+	  prog);
+}
+
+int main(int argc, char* argv[]) {
+  struct kitgen_opts opts;
+  int c,k;
+
+  opts.kits = 4;
+  opts.instruments = 16;
+  opts.layers = 4;
+  opts.sample_secs = 1.0f;
+  opts.rate = 44100;
+  opts.channels = 2;
+  opts.flac = 0;
+  opts.seed = 1;
+
+  while ((c = getopt(argc,argv,"k:i:l:d:r:c:fs:h")) != -1) {
+    switch (c) {
+    case 'k': opts.kits = atoi(optarg); break;
+    case 'i': opts.instruments = atoi(optarg); break;
+    case 'l': opts.layers = atoi(optarg); break;
+    case 'd': opts.sample_secs = atof(optarg); break;
+    case 'r': opts.rate = atoi(optarg); break;
+    case 'c': opts.channels = atoi(optarg); break;
+    case 'f': opts.flac = 1; break;
+    case 's': opts.seed = atoi(optarg); break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (optind != argc-1 || opts.kits < 1 || opts.instruments < 1 ||
+      opts.layers < 0 || opts.rate <= 0 || opts.sample_secs < 0 ||
+      opts.channels < 1 || opts.channels > 2) {
+    usage(argv[0]);
+    return 1;
+  }
+  opts.out_dir = argv[optind];
+  rand_state = opts.seed;
+
+  if (make_dir(opts.out_dir)) return 1;
+  for (k = 0;k < opts.kits;k++)
+    if (write_kit(&opts,k)) return 1;
+  printf("wrote %i kits to %s\n",opts.kits,opts.out_dir);
+  return 0;
+}
@@ -22,12 +22,27 @@
 #include "drmr_hydrogen.h"
 #include "nknob.h"
 #include "lv2/lv2plug.in/ns/extensions/ui/ui.h"
+#include "lv2/lv2plug.in/ns/ext/atom/util.h"
 
 #define DRMR_UI_URI "http://github.com/nicklan/drmr#ui"
 
 typedef struct {
   LV2UI_Write_Function write;
   LV2UI_Controller     controller;
+  LV2_Atom_Forge forge;
+  struct {
+    LV2_URID atom_event_transfer;
+    LV2_URID patch_get;
+    LV2_URID patch_set;
+    LV2_URID patch_property;
+    LV2_URID patch_value;
+    LV2_URID instrument;
+    LV2_URID gain;
+    LV2_URID pan;
+    LV2_URID block_times;
+    LV2_URID active_voices;
+    LV2_URID kit_path;
+  } uris;
 
   GtkWidget *drmr_widget;
   GtkTable *sample_table;
@@ -39,7 +54,17 @@ typedef struct {
   GtkWidget** gain_sliders;
   GtkWidget** pan_sliders;
   GtkWidget *velocity_checkbox, *note_off_checkbox;
+  GtkLabel *stats_label;
+  // last gains and pans the plugin told us about, to re-apply to the
+  // sliders when we change kits
   float *gain_vals,*pan_vals;
+  int num_vals;
+  float dsp_load, peak_time, kit_memory;
+  int active_voices;
+  // from the plugin's last histograms: the time 99% of blocks took
+  // less than, and the most voices any block mixed
+  float p99_time;
+  int max_voices;
 
   gchar *bundle_path;
 
@@ -54,15 +79,79 @@ typedef struct {
 
   int curKit;
   int kitReq;
+  gboolean path_seen; // the plugin tells us its kit by path
   kits* kits;
+  kit_watch* kit_watch;
+  guint kit_watch_source;
+  gboolean refilling;  // kit combo is being rebuilt, ignore its changes
 } DrMrUi;
 
+// make room for values of at least n samples, new ones are 0
+static void grow_vals(DrMrUi* ui, int n) {
+  if (n <= ui->num_vals) return;
+  ui->gain_vals = realloc(ui->gain_vals,n*sizeof(float));
+  ui->pan_vals = realloc(ui->pan_vals,n*sizeof(float));
+  memset(ui->gain_vals+ui->num_vals,0,(n-ui->num_vals)*sizeof(float));
+  memset(ui->pan_vals+ui->num_vals,0,(n-ui->num_vals)*sizeof(float));
+  ui->num_vals = n;
+}
+
+// send a patch:Get, the plugin answers with every gain and pan
+static void request_params(DrMrUi* ui) {
+  uint8_t buf[64];
+  LV2_Atom_Forge_Frame frame;
+  LV2_Atom* msg;
+  lv2_atom_forge_set_buffer(&ui->forge,buf,sizeof(buf));
+  msg = (LV2_Atom*)lv2_atom_forge_object(&ui->forge,&frame,0,ui->uris.patch_get);
+  lv2_atom_forge_pop(&ui->forge,&frame);
+  ui->write(ui->controller,DRMR_CONTROL,lv2_atom_total_size(msg),
+	    ui->uris.atom_event_transfer,msg);
+}
+
+// send a patch:Set of the gain or pan of one sample
+static void send_param(DrMrUi* ui, LV2_URID prop, int idx, float val) {
+  uint8_t buf[128];
+  LV2_Atom_Forge_Frame frame;
+  LV2_Atom* msg;
+  lv2_atom_forge_set_buffer(&ui->forge,buf,sizeof(buf));
+  msg = (LV2_Atom*)lv2_atom_forge_object(&ui->forge,&frame,0,ui->uris.patch_set);
+  lv2_atom_forge_key(&ui->forge,ui->uris.patch_property);
+  lv2_atom_forge_urid(&ui->forge,prop);
+  lv2_atom_forge_key(&ui->forge,ui->uris.instrument);
+  lv2_atom_forge_int(&ui->forge,idx);
+  lv2_atom_forge_key(&ui->forge,ui->uris.patch_value);
+  lv2_atom_forge_float(&ui->forge,val);
+  lv2_atom_forge_pop(&ui->forge,&frame);
+  ui->write(ui->controller,DRMR_CONTROL,lv2_atom_total_size(msg),
+	    ui->uris.atom_event_transfer,msg);
+}
+
+// send a patch:Set of the kit path, the plugin loads that kit
+static void send_kit_path(DrMrUi* ui, const char* path) {
+  uint32_t len = strlen(path);
+  uint32_t size = len+128;
+  uint8_t* buf = malloc(size);
+  LV2_Atom_Forge_Frame frame;
+  LV2_Atom* msg;
+  lv2_atom_forge_set_buffer(&ui->forge,buf,size);
+  msg = (LV2_Atom*)lv2_atom_forge_object(&ui->forge,&frame,0,ui->uris.patch_set);
+  lv2_atom_forge_key(&ui->forge,ui->uris.patch_property);
+  lv2_atom_forge_urid(&ui->forge,ui->uris.kit_path);
+  lv2_atom_forge_key(&ui->forge,ui->uris.patch_value);
+  lv2_atom_forge_path(&ui->forge,path,len);
+  lv2_atom_forge_pop(&ui->forge,&frame);
+  ui->write(ui->controller,DRMR_CONTROL,lv2_atom_total_size(msg),
+	    ui->uris.atom_event_transfer,msg);
+  free(buf);
+}
+
 static gboolean gain_callback(GtkRange* range, GtkScrollType type, gdouble value, gpointer data) {
   DrMrUi* ui = (DrMrUi*)data;
   int gidx = GPOINTER_TO_INT(g_object_get_qdata(G_OBJECT(range),ui->gain_quark));
   float gain = (float)value;
+  grow_vals(ui,gidx+1);
   ui->gain_vals[gidx] = gain;
-  ui->write(ui->controller,gidx+DRMR_GAIN_ONE,4,0,&gain);
+  send_param(ui,ui->uris.gain,gidx,gain);
   return FALSE;
 }
 
@@ -70,8 +159,9 @@ static gboolean pan_callback(GtkRange* range, GtkScrollType type, gdouble value,
   DrMrUi* ui = (DrMrUi*)data;
   int pidx = GPOINTER_TO_INT(g_object_get_qdata(G_OBJECT(range),ui->pan_quark));
   float pan = (float)value;
+  grow_vals(ui,pidx+1);
   ui->pan_vals[pidx] = pan;
-  ui->write(ui->controller,pidx+DRMR_PAN_ONE,4,0,&pan);
+  send_param(ui,ui->uris.pan,pidx,pan);
   return FALSE;
 }
 
@@ -144,10 +234,7 @@ static void fill_sample_table(DrMrUi* ui, int samples, char** names,GtkWidget**
 #endif
     g_object_set_qdata (G_OBJECT(gain_slider),ui->gain_quark,GINT_TO_POINTER(si));
     if (gain_sliders) gain_sliders[si] = gain_slider;
-    if (si < 32)
-      gtk_range_set_value(GTK_RANGE(gain_slider),ui->gain_vals[si]);
-    else // things are gross if we have > 32 samples, what to do?
-      gtk_range_set_value(GTK_RANGE(gain_slider),0.0);
+    gtk_range_set_value(GTK_RANGE(gain_slider),si < ui->num_vals ? ui->gain_vals[si] : 0.0);
     g_signal_connect(G_OBJECT(gain_slider),"change-value",G_CALLBACK(gain_callback),ui);
     gain_label = gtk_label_new("Gain");
     gain_vbox = gtk_vbox_new(false,0);
@@ -161,10 +248,7 @@ static void fill_sample_table(DrMrUi* ui, int samples, char** names,GtkWidget**
     gtk_widget_set_has_tooltip(pan_slider,TRUE);
 #endif
     if (pan_sliders) pan_sliders[si] = pan_slider;
-    if (si < 32)
-      gtk_range_set_value(GTK_RANGE(pan_slider),ui->pan_vals[si]);
-    else
-      gtk_range_set_value(GTK_RANGE(pan_slider),0);
+    gtk_range_set_value(GTK_RANGE(pan_slider),si < ui->num_vals ? ui->pan_vals[si] : 0.0);
     g_object_set_qdata (G_OBJECT(pan_slider),ui->pan_quark,GINT_TO_POINTER(si));
     g_signal_connect(G_OBJECT(pan_slider),"change-value",G_CALLBACK(pan_callback),ui);
     pan_label = gtk_label_new("Pan");
@@ -229,13 +313,27 @@ static void base_changed(GtkSpinButton *base_spin, gpointer data) {
     fprintf(stderr,"Base spin got out of range: %f\n",base);
 }
 
+static void update_stats_label(DrMrUi* ui) {
+  gchar buf[192];
+  snprintf(buf,192,"DSP: %.1f%%  Voices: %i (max %i%s)  Peak: %.0f us  99%%: <%.0f us  Mem: %.1f MB",
+	   ui->dsp_load,ui->active_voices,ui->max_voices,
+	   ui->max_voices >= DRMR_VOICE_BINS-1 ? "+" : "",
+	   ui->peak_time,ui->p99_time,ui->kit_memory);
+  gtk_label_set_text(ui->stats_label,buf);
+}
+
 static void fill_kit_combo(GtkComboBox* combo, kits* kits) {
   int i;
   GtkTreeIter iter;
   GtkListStore *store = GTK_LIST_STORE(gtk_combo_box_get_model(combo));
   for (i=0;i<kits->num_kits;i++) {
     gtk_list_store_append (store, &iter);
-    gtk_list_store_set(store, &iter, 0, kits->kits[i].name, -1);
+    if (kits->kits[i].removed) {
+      gchar* name = g_strdup_printf("%s (removed)",kits->kits[i].name);
+      gtk_list_store_set(store, &iter, 0, name, -1);
+      g_free(name);
+    } else
+      gtk_list_store_set(store, &iter, 0, kits->kits[i].name, -1);
   }
 }
 
@@ -291,9 +389,10 @@ static gboolean kit_callback(gpointer data) {
 static void kit_combobox_changed(GtkComboBox* box, gpointer data) {
   DrMrUi* ui = (DrMrUi*)data;
   gint new_kit = gtk_combo_box_get_active (GTK_COMBO_BOX(box));
-  float fkit = (float)new_kit;
-  if (ui->curKit != new_kit)
-    ui->write(ui->controller,DRMR_KITNUM,4,0,&fkit);
+  if (ui->refilling) return;
+  // by path, the plugin's kit list might not be in the same order
+  if (ui->curKit != new_kit && new_kit >= 0 && new_kit < ui->kits->num_kits)
+    send_kit_path(ui,ui->kits->kits[new_kit].path);
 
   /* Call our update func after 100 milliseconds.
    *
@@ -305,6 +404,24 @@ static void kit_combobox_changed(GtkComboBox* box, gpointer data) {
   g_timeout_add(100,kit_callback,ui);
 }
 
+// kits were added, edited or removed on disk
+static gboolean kits_changed(GIOChannel* source, GIOCondition cond, gpointer data) {
+  DrMrUi* ui = (DrMrUi*)data;
+  if (update_kits(ui->kit_watch,ui->kits) > 0) {
+    // indices don't change, so just rebuild the list and reselect
+    ui->refilling = TRUE;
+    gtk_list_store_clear(ui->kit_store);
+    fill_kit_combo(ui->kit_combo, ui->kits);
+    gtk_combo_box_set_active(ui->kit_combo,ui->curKit);
+    ui->refilling = FALSE;
+    // the current kit's instruments might have changed
+    ui->kitReq = ui->curKit;
+    ui->forceUpdate = true;
+    g_idle_add(kit_callback,ui);
+  }
+  return TRUE; // keep watching
+}
+
 static void position_combobox_changed(GtkComboBox* box, gpointer data) {
   DrMrUi* ui = (DrMrUi*)data;
   gint ss = gtk_combo_box_get_active (GTK_COMBO_BOX(box));
@@ -355,7 +472,7 @@ static void build_drmr_ui(DrMrUi* ui) {
   GtkWidget *drmr_ui_widget;
   GtkWidget *opts_hbox1, *opts_hbox2, 
     *kit_combo_box, *kit_label, *no_kit_label,
-    *base_label, *base_spin, *position_label, *position_combo_box;
+    *base_label, *base_spin, *position_label, *position_combo_box, *stats_label;
   GtkCellRenderer *cell_rend;
   GtkAdjustment *base_adj;
   
@@ -390,6 +507,7 @@ static void build_drmr_ui(DrMrUi* ui) {
 
   ui->velocity_checkbox = gtk_check_button_new_with_label("Ignore Velocity");
   ui->note_off_checkbox = gtk_check_button_new_with_label("Ignore Note Off");
+  stats_label = gtk_label_new("");
 
   gtk_box_pack_start(GTK_BOX(opts_hbox1),kit_label,
 		     false,false,15);
@@ -410,6 +528,8 @@ static void build_drmr_ui(DrMrUi* ui) {
 		     true,true,15);
   gtk_box_pack_start(GTK_BOX(opts_hbox2),ui->note_off_checkbox,
 		     true,true,15);
+  gtk_box_pack_start(GTK_BOX(opts_hbox2),stats_label,
+		     false,false,15);
 
   gtk_box_pack_start(GTK_BOX(drmr_ui_widget),gtk_hseparator_new(),
 		     false,false,5);
@@ -426,6 +546,7 @@ static void build_drmr_ui(DrMrUi* ui) {
   ui->base_label = GTK_LABEL(base_label);
   ui->base_spin = GTK_SPIN_BUTTON(base_spin);
   ui->no_kit_label = no_kit_label;
+  ui->stats_label = GTK_LABEL(stats_label);
 
   g_signal_connect(G_OBJECT(kit_combo_box),"changed",G_CALLBACK(kit_combobox_changed),ui);
   g_signal_connect(G_OBJECT(base_spin),"value-changed",G_CALLBACK(base_changed),ui);
@@ -445,30 +566,62 @@ instantiate(const LV2UI_Descriptor*   descriptor,
             LV2UI_Controller          controller,
             LV2UI_Widget*             widget,
             const LV2_Feature* const* features) {
-  DrMrUi     *ui = (DrMrUi*)malloc(sizeof(DrMrUi));
+  DrMrUi     *ui;
+  LV2_URID_Map *map = NULL;
+
+  for (;features && *features;features++)
+    if (!strcmp((*features)->URI, LV2_URID_MAP_URI))
+      map = (LV2_URID_Map *)((*features)->data);
+  if (!map) {
+    fprintf(stderr, "LV2 host does not support urid:map, can't show DrMr UI.\n");
+    return NULL;
+  }
+
+  ui = (DrMrUi*)malloc(sizeof(DrMrUi));
+  lv2_atom_forge_init(&ui->forge,map);
+  ui->uris.atom_event_transfer = map->map(map->handle,LV2_ATOM__eventTransfer);
+  ui->uris.patch_get = map->map(map->handle,LV2_PATCH__Get);
+  ui->uris.patch_set = map->map(map->handle,LV2_PATCH__Set);
+  ui->uris.patch_property = map->map(map->handle,LV2_PATCH__property);
+  ui->uris.patch_value = map->map(map->handle,LV2_PATCH__value);
+  ui->uris.instrument = map->map(map->handle,DRMR_URI "#instrument");
+  ui->uris.gain = map->map(map->handle,DRMR_URI "#gain");
+  ui->uris.pan = map->map(map->handle,DRMR_URI "#pan");
+  ui->uris.block_times = map->map(map->handle,DRMR_URI "#blockTimes");
+  ui->uris.active_voices = map->map(map->handle,DRMR_URI "#activeVoices");
+  ui->uris.kit_path = map->map(map->handle,DRMR_URI "#kitPath");
 
   ui->write      = write_function;
   ui->controller = controller;
   ui->drmr_widget = NULL;
   ui->curKit = -1;
+  ui->path_seen = FALSE;
   ui->samples = 0;
   ui->bundle_path = g_strdup(bundle_path);
   *widget = NULL;
 
+  ui->dsp_load = ui->peak_time = ui->kit_memory = 0.0f;
+  ui->active_voices = ui->max_voices = 0;
+  ui->p99_time = 0.0f;
   build_drmr_ui(ui);
+  update_stats_label(ui);
 
   ui->kits = scan_kits();
+  ui->refilling = FALSE;
+  ui->kit_watch_source = 0;
+  ui->kit_watch = watch_kits();
+  if (ui->kit_watch) {
+    GIOChannel* chan = g_io_channel_unix_new(kit_watch_fd(ui->kit_watch));
+    ui->kit_watch_source = g_io_add_watch(chan,G_IO_IN,kits_changed,ui);
+    g_io_channel_unref(chan);
+  }
   ui->gain_quark = g_quark_from_string("drmr_gain_quark");
   ui->pan_quark = g_quark_from_string("drmr_pan_quark");
   ui->gain_sliders = NULL;
   ui->pan_sliders = NULL;
 
-  // store previous gain/pan vals to re-apply to sliders when we
-  // change kits
-  ui->gain_vals = malloc(32*sizeof(float));
-  memset(ui->gain_vals,0,32*sizeof(float));
-  ui->pan_vals  = malloc(32*sizeof(float));
-  memset(ui->pan_vals,0,32*sizeof(float));
+  ui->gain_vals = ui->pan_vals = NULL;
+  ui->num_vals = 0;
   ui->cols = 4;
   ui->forceUpdate = false;
   fill_kit_combo(ui->kit_combo, ui->kits);
@@ -481,6 +634,7 @@ instantiate(const LV2UI_Descriptor*   descriptor,
 
 
   *widget = ui->drmr_widget;
+  request_params(ui);
 
   return ui;
 }
@@ -494,7 +648,11 @@ static void cleanup(LV2UI_Handle handle) {
     gtk_widget_destroy(ui->drmr_widget);
   if (ui->gain_sliders) free(ui->gain_sliders);
   if (ui->pan_sliders) free(ui->pan_sliders);
+  free(ui->gain_vals);
+  free(ui->pan_vals);
   g_free(ui->bundle_path);
+  if (ui->kit_watch_source) g_source_remove(ui->kit_watch_source);
+  if (ui->kit_watch) free_kit_watch(ui->kit_watch);
   free_kits(ui->kits);
   free(ui);
 }
@@ -511,6 +669,101 @@ static gboolean slider_callback(gpointer data) {
   return FALSE; // don't keep calling
 }
 
+// a gain or pan the plugin sent us
+static void param_changed(DrMrUi* ui, LV2_URID prop, int idx, float val) {
+  GtkWidget** sliders;
+  grow_vals(ui,idx+1);
+  if (prop == ui->uris.gain) {
+    ui->gain_vals[idx] = val;
+    sliders = ui->gain_sliders;
+  } else {
+    ui->pan_vals[idx] = val;
+    sliders = ui->pan_sliders;
+  }
+  if (idx < ui->samples && sliders) {
+    struct slider_callback_data* data = malloc(sizeof(struct slider_callback_data));
+    data->range = GTK_RANGE(sliders[idx]);
+    data->val = val;
+    g_idle_add(slider_callback,data);
+  }
+}
+
+// a block time or voice count histogram the plugin sent us
+static void hist_changed(DrMrUi* ui, LV2_URID prop, const int32_t* hist, int n) {
+  int i;
+  if (prop == ui->uris.block_times) {
+    // bin i counts blocks taking [2^i,2^(i+1)) ns
+    uint64_t total = 0,sum = 0;
+    for (i = 0;i < n;i++) total += hist[i];
+    if (total == 0) return;
+    for (i = 0;i < n-1;i++) {
+      sum += hist[i];
+      if (sum*100 >= total*99) break;
+    }
+    ui->p99_time = (2ull<<i)/1000.0f;
+  } else {
+    for (i = n-1;i > 0 && hist[i] == 0;i--);
+    ui->max_voices = i;
+  }
+  update_stats_label(ui);
+}
+
+/* patch:Set messages from the notify port, either of one sample's gain
+ * or pan, or of those of every sample as a vector, or of one of the
+ * stats histograms as a vector of ints, or of the kit's path. */
+static void notify_event(DrMrUi* ui, const LV2_Atom_Object* obj) {
+  const LV2_Atom *property = NULL, *value = NULL, *inst = NULL;
+  LV2_URID prop;
+  if (obj->body.otype != ui->uris.patch_set) return;
+  lv2_atom_object_get(obj,
+		      ui->uris.patch_property,&property,
+		      ui->uris.patch_value,&value,
+		      ui->uris.instrument,&inst,
+		      0);
+  if (!property || !value || property->type != ui->forge.URID) return;
+  prop = ((const LV2_Atom_URID*)property)->body;
+  if (prop == ui->uris.kit_path) {
+    const char* path = (const char*)LV2_ATOM_BODY_CONST(value);
+    int i;
+    if (value->type != ui->forge.Path || !value->size || path[value->size-1]) return;
+    ui->path_seen = TRUE;
+    for (i = 0;i < ui->kits->num_kits;i++)
+      if (!strcmp(ui->kits->kits[i].path,path)) break;
+    if (i == ui->kits->num_kits) {
+      fprintf(stderr,"Plugin is playing a kit the UI doesn't know: %s\n",path);
+      return;
+    }
+    ui->kitReq = i;
+    if (!idle) {
+      idle = TRUE;
+      g_idle_add(kit_callback,ui);
+    }
+    return;
+  }
+  if (prop == ui->uris.block_times || prop == ui->uris.active_voices) {
+    const LV2_Atom_Vector* vec = (const LV2_Atom_Vector*)value;
+    if (value->type != ui->forge.Vector || vec->body.child_type != ui->forge.Int)
+      return;
+    hist_changed(ui,prop,(const int32_t*)(vec+1),
+		 (vec->atom.size-sizeof(LV2_Atom_Vector_Body))/sizeof(int32_t));
+    return;
+  }
+  if (prop != ui->uris.gain && prop != ui->uris.pan) return;
+  if (inst && inst->type == ui->forge.Int && value->type == ui->forge.Float) {
+    int idx = ((const LV2_Atom_Int*)inst)->body;
+    if (idx >= 0)
+      param_changed(ui,prop,idx,((const LV2_Atom_Float*)value)->body);
+  } else if (!inst && value->type == ui->forge.Vector) {
+    const LV2_Atom_Vector* vec = (const LV2_Atom_Vector*)value;
+    const float* vals = (const float*)(vec+1);
+    int i,n;
+    if (vec->body.child_type != ui->forge.Float) return;
+    n = (vec->atom.size-sizeof(LV2_Atom_Vector_Body))/sizeof(float);
+    for (i = n-1;i >= 0;i--) // last first, so the arrays only grow once
+      param_changed(ui,prop,i,vals[i]);
+  }
+}
+
 static void
 port_event(LV2UI_Handle handle,
            uint32_t     port_index,
@@ -523,7 +776,9 @@ port_event(LV2UI_Handle handle,
   if (index == DRMR_KITNUM) {
     if (format != 0) 
       fprintf(stderr,"Invalid format for kitnum: %i\n",format);
-    else {
+    else if (!ui->path_seen) {
+      // only from plugins that don't send their kit's path, an index
+      // into their kit list, which might not be ours
       int kit = (int)(*((float*)buffer));
       ui->kitReq = kit;
       if (!idle) {
@@ -550,31 +805,27 @@ port_event(LV2UI_Handle handle,
     gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(ui->note_off_checkbox),
 				 ig?TRUE:FALSE);
   }
-  else if (index >= DRMR_GAIN_ONE &&
-	   index <= DRMR_GAIN_THIRTYTWO) {
-    float gain = *(float*)buffer;
-    int idx = index-DRMR_GAIN_ONE;
-    ui->gain_vals[idx] = gain;
-    if (idx < ui->samples && ui->gain_sliders) {
-      struct slider_callback_data* data = malloc(sizeof(struct slider_callback_data));
-      data->range = GTK_RANGE(ui->gain_sliders[idx]);
-      data->val = gain;
-      g_idle_add(slider_callback,data);
-      //GtkRange* range = GTK_RANGE(ui->gain_sliders[idx]);
-      //gtk_range_set_value(range,gain);
-    }
+  else if (index == DRMR_DSP_LOAD) {
+    ui->dsp_load = *(float*)buffer;
+    update_stats_label(ui);
   }
-  else if (index >= DRMR_PAN_ONE &&
-	   index <= DRMR_PAN_THIRTYTWO) {
-    float pan = *(float*)buffer;
-    int idx = index-DRMR_PAN_ONE;
-    ui->pan_vals[idx] = pan;
-    if (idx < ui->samples && ui->pan_sliders) {
-      struct slider_callback_data* data = malloc(sizeof(struct slider_callback_data));
-      data->range = GTK_RANGE(ui->pan_sliders[idx]);
-      data->val = pan;
-      g_idle_add(slider_callback,data);
-    }
+  else if (index == DRMR_ACTIVE_VOICES) {
+    ui->active_voices = (int)(*(float*)buffer);
+    update_stats_label(ui);
+  }
+  else if (index == DRMR_PEAK_TIME) {
+    ui->peak_time = *(float*)buffer;
+    update_stats_label(ui);
+  }
+  else if (index == DRMR_KIT_MEMORY) {
+    ui->kit_memory = *(float*)buffer;
+    update_stats_label(ui);
+  }
+  else if (index == DRMR_NOTIFY) {
+    const LV2_Atom* atom = (const LV2_Atom*)buffer;
+    if (format == ui->uris.atom_event_transfer &&
+	(atom->type == ui->forge.Object || atom->type == ui->forge.Blank))
+      notify_event(ui,(const LV2_Atom_Object*)atom);
   }
 }
 